@@ -22,12 +22,93 @@
 
 #include <libsoup/soup.h>
 
-#include "facebook-http.h"
-#include "facebook-util.h"
+#include "fb-capture.h"
+#include "fb-http-ext.h"
+#include "fb-http-stats.h"
+#include "fb-http-trace.h"
+
+/* limits of the session shared by all FbHttp instances */
+#define FB_HTTP_MAX_CONNS 16
+#define FB_HTTP_MAX_CONNS_PER_HOST 4
+/* seconds an idle keep-alive connection is kept open */
+#define FB_HTTP_IDLE_TIMEOUT 60
+/* seconds a connection may sit without any I/O during a request */
+#define FB_HTTP_IO_TIMEOUT 60
+/* seconds from fb_http_request_send() to the callback, unless set */
+#define FB_HTTP_REQUEST_TIMEOUT 120
+
+#define FB_HTTP_ACCEPT_ENCODING "gzip, deflate"
+
+/* attempts a request gets at most, the first one included */
+#define FB_HTTP_RETRY_ATTEMPTS 4
+/* milliseconds, the backoff doubles from the base up to the cap */
+#define FB_HTTP_RETRY_BASE 500
+#define FB_HTTP_RETRY_CAP 30000
+/* seconds of Retry-After we are willing to wait for */
+#define FB_HTTP_RETRY_AFTER_MAX 60
+/* consecutive failures that open the circuit of a host, and for how many
+ * seconds it stays open */
+#define FB_HTTP_BREAKER_THRESHOLD 5
+#define FB_HTTP_BREAKER_OPEN 30
+
+/* libsoup 2.4 has no name for it */
+#define FB_HTTP_STATUS_TOO_MANY_REQUESTS 429
+
+/* requests of each priority class allowed in flight at once */
+static const guint fb_http_class_max[FB_HTTP_PRIORITY_N] =
+{
+  FB_HTTP_MAX_CONNS, /* critical */
+  FB_HTTP_MAX_CONNS - 2, /* interactive */
+  2 /* background */
+};
+
+static const SoupMessagePriority fb_http_class_soup_priority[] =
+{
+  SOUP_MESSAGE_PRIORITY_VERY_HIGH,
+  SOUP_MESSAGE_PRIORITY_NORMAL,
+  SOUP_MESSAGE_PRIORITY_VERY_LOW
+};
+
+/* sits in front of the session, which would just run everything FIFO */
+struct _FbHttpScheduler
+{
+  GQueue pending[FB_HTTP_PRIORITY_N];
+  guint active[FB_HTTP_PRIORITY_N];
+  guint total;
+};
+
+typedef struct _FbHttpScheduler FbHttpScheduler;
+
+static FbHttpScheduler fb_http_scheduler;
+
+/* stops us from hammering a host that keeps failing */
+struct _FbHttpBreaker
+{
+  guint failures;
+  /* monotonic time until which requests fail right away */
+  gint64 open_until;
+  /* a request is finding out whether the host is back */
+  gboolean probing;
+};
+
+typedef struct _FbHttpBreaker FbHttpBreaker;
+
+/* host -> FbHttpBreaker */
+static GHashTable *fb_http_breakers = NULL;
+
+/* see fb_http_push_cancellable() */
+static GSList *fb_http_cancellables = NULL;
+
+/* see fb_http_add_idempotent_url() */
+static GSList *fb_http_idempotent_urls = NULL;
+
+/* see fb_http_add_critical_url() */
+static GSList *fb_http_critical_urls = NULL;
 
 struct _FbHttpPrivate
 {
   SoupSession *session;
+  gchar *agent;
 };
 
 struct _FbHttpRequestPrivate
@@ -41,6 +122,52 @@ struct _FbHttpRequestPrivate
   FbHttpValues *headers;
   FbHttpValues *params;
   GError *error;
+  gboolean conditional;
+  FbHttpChunkFunc chunk_func;
+  gpointer chunk_data;
+  /* set once the headers say the body is worth streaming */
+  gboolean streaming;
+  /* we decode ourselves, soup wouldn't let us see the compressed size */
+  GConverter *decoder;
+  /* the decoder saw the end of the stream */
+  gboolean decoded;
+  /* the decoded body, unless streaming */
+  GByteArray *body;
+  /* the body turns into this, without a copy, once the request is done */
+  GBytes *bytes;
+  gsize wire_size;
+  gsize body_size;
+  /* NULL unless tracing is enabled */
+  FbHttpTraceRecord *trace;
+  /* monotonic times of the request phases, 0 if not reached */
+  gint64 queued;
+  gint64 resolving;
+  gint64 resolved;
+  gint64 connecting;
+  gint64 connected;
+  gint64 handshaking;
+  gint64 handshaked;
+  gint64 starting;
+  gint64 first_byte;
+  FbHttpPriority priority;
+  /* in the scheduler queue until dispatched */
+  GList link;
+  gboolean pending;
+  gboolean dispatched;
+  gboolean aborted;
+  gboolean done;
+  GCancellable *cancellable;
+  gulong cancelled_id;
+  guint timeout;
+  guint timeout_id;
+  /* monotonic time the timeout fires at, 0 if none */
+  gint64 deadline;
+  gboolean idempotent;
+  guint attempts;
+  /* waiting for the next attempt, or to be rejected */
+  guint retry_id;
+  /* the request that tests a half open circuit */
+  gboolean probe;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(FbHttp, fb_http, G_TYPE_OBJECT);
@@ -63,6 +190,29 @@ fb_http_error_quark(void)
     return q;
 }
 
+/* all accounts and avatar fetchers of the process share one session, so
+ * they share its pool of warm connections too */
+static SoupSession *
+fb_http_session_ref_shared(void)
+{
+  static SoupSession *shared = NULL;
+
+  if (shared)
+    return g_object_ref(shared);
+
+  shared = soup_session_new_with_options(
+    SOUP_SESSION_MAX_CONNS, FB_HTTP_MAX_CONNS,
+    SOUP_SESSION_MAX_CONNS_PER_HOST, FB_HTTP_MAX_CONNS_PER_HOST,
+    SOUP_SESSION_IDLE_TIMEOUT, FB_HTTP_IDLE_TIMEOUT,
+    SOUP_SESSION_TIMEOUT, FB_HTTP_IO_TIMEOUT,
+    NULL);
+
+  /* recreated on demand once the last user is gone */
+  g_object_add_weak_pointer(G_OBJECT(shared), (gpointer *)&shared);
+
+  return shared;
+}
+
 void
 fb_http_set_agent(FbHttp *http, const gchar *agent)
 {
@@ -72,9 +222,9 @@ fb_http_set_agent(FbHttp *http, const gchar *agent)
 
   priv = FB_HTTP_PRIVATE(http);
 
-  g_object_set(priv->session,
-               SOUP_SESSION_USER_AGENT, agent,
-               NULL);
+  /* the session is shared, so the agent goes with each request */
+  g_free(priv->agent);
+  priv->agent = g_strdup(agent);
 }
 
 static void
@@ -89,6 +239,9 @@ fb_http_dispose(GObject *object)
       priv->session = NULL;
     }
 
+    g_free(priv->agent);
+    priv->agent = NULL;
+
     G_OBJECT_CLASS(fb_http_parent_class)->dispose(object);
 }
 
@@ -103,7 +256,7 @@ fb_http_init(FbHttp *http)
 {
   FbHttpPrivate *priv = FB_HTTP_PRIVATE(http);
 
-  priv->session = soup_session_new();
+  priv->session = fb_http_session_ref_shared();
 }
 
 FbHttp *
@@ -118,64 +271,168 @@ fb_http_new(const gchar *agent)
 }
 
 static void
-_print_headers(SoupMessageHeaders *headers)
+on_request_network_event(SoupMessage *msg, GSocketClientEvent event,
+                         GIOStream *connection, gpointer user_data)
 {
-    SoupMessageHeadersIter iter;
-    const char *name, *value;
+  FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(user_data);
+  gint64 now = g_get_monotonic_time();
 
-    soup_message_headers_iter_init(&iter, headers);
+  switch (event)
+  {
+    case G_SOCKET_CLIENT_RESOLVING:
+      priv->resolving = now;
+      break;
+    case G_SOCKET_CLIENT_RESOLVED:
+      priv->resolved = now;
+      break;
+    case G_SOCKET_CLIENT_CONNECTING:
+      priv->connecting = now;
+      break;
+    case G_SOCKET_CLIENT_CONNECTED:
+      priv->connected = now;
+      break;
+    case G_SOCKET_CLIENT_TLS_HANDSHAKING:
+      priv->handshaking = now;
+      break;
+    case G_SOCKET_CLIENT_TLS_HANDSHAKED:
+      priv->handshaked = now;
+      break;
+    default:
+      break;
+  }
+}
 
-    while(soup_message_headers_iter_next(&iter, &name, &value))
-      fb_util_debug_info("  %s=%s", name, value);
+static void
+on_request_starting(SoupMessage *msg, gpointer user_data)
+{
+  FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(user_data);
+
+  priv->starting = g_get_monotonic_time();
 }
 
 static void
-_print_body(SoupMessageBody *body, gboolean flatten)
+on_request_got_headers(SoupMessage *msg, gpointer user_data)
 {
-  if (body->length > 0)
+  FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(user_data);
+  const gchar *encoding;
+
+  priv->first_byte = g_get_monotonic_time();
+
+  /* error responses go to the callback whole, like they always did */
+  priv->streaming = priv->chunk_func && msg->status_code == SOUP_STATUS_OK;
+
+  /* redirects come with a body of their own, only the last one counts */
+  g_byte_array_set_size(priv->body, 0);
+  g_clear_object(&priv->decoder);
+  priv->decoded = FALSE;
+  priv->wire_size = 0;
+  priv->body_size = 0;
+
+  encoding = soup_message_headers_get_one(msg->response_headers,
+                                          "Content-Encoding");
+
+  if (!g_strcmp0(encoding, "gzip") || !g_strcmp0(encoding, "x-gzip"))
   {
-    if (flatten)
-      soup_message_body_flatten(body);
+    priv->decoder = G_CONVERTER(
+      g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+  }
+  else if (!g_strcmp0(encoding, "deflate"))
+  {
+    priv->decoder = G_CONVERTER(
+      g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB));
+  }
+}
 
-    gchar **lines = g_strsplit(body->data, "\n", 0);
+static void
+fb_http_request_deliver(FbHttpRequest *req, const gchar *data, gsize size)
+{
+  FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(req);
 
-    for (int i = 0; lines[i] != NULL; i++)
-        fb_util_debug_info("  %s", lines[i]);
+  priv->body_size += size;
 
-    g_strfreev(lines);
+  if (!priv->streaming)
+  {
+    g_byte_array_append(priv->body, (const guint8 *)data, size);
+    return;
   }
-  else
-    fb_util_debug_info("  ** No body data **");
+
+  priv->chunk_func(req, data, size, priv->chunk_data);
+
+  /* a capture wants the whole body all the same */
+  if (G_UNLIKELY(fb_capture_enabled()))
+    g_byte_array_append(priv->body, (const guint8 *)data, size);
 }
 
+/* runs @in through the decoder, and keeps going for as long as it fills the
+ * output buffer, zlib may hold output after it took all the input */
 static void
-on_request_starting(SoupMessage *msg, gpointer user_data)
+fb_http_request_decode(FbHttpRequest *req, const gchar *in, gsize in_size,
+                       GConverterFlags flags)
 {
-  SoupURI *uri = soup_message_get_uri(msg);
+  FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(req);
+  gchar out[4096];
+  gsize read;
+  gsize written;
 
-  g_print("%s %s HTTP/1.1\n", msg->method, soup_uri_to_string(uri, FALSE));
+  do
+  {
+    GConverterResult res;
+    GError *error = NULL;
 
-  fb_util_debug_info("%s Request (%p): %s", msg->method, user_data,
-                     soup_uri_to_string(uri, FALSE));
+    res = g_converter_convert(priv->decoder, in, in_size, out, sizeof(out),
+                              flags, &read, &written, &error);
 
-  _print_headers(msg->request_headers);
-  _print_body(msg->request_body, TRUE);
+    if (res == G_CONVERTER_ERROR)
+    {
+      /* nothing more to give out until the next chunk, at the end of the
+       * input that means the stream is truncated */
+      if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT))
+      {
+        g_error_free(error);
+        return;
+      }
+
+      /* the rest of the body is garbage, keep the error for the callback */
+      if (priv->error)
+        g_error_free(error);
+      else
+        priv->error = error;
+
+      g_clear_object(&priv->decoder);
+      return;
+    }
+
+    fb_http_request_deliver(req, out, written);
+    in += read;
+    in_size -= read;
+
+    if (res == G_CONVERTER_FINISHED)
+    {
+      priv->decoded = TRUE;
+      return;
+    }
+  }
+  while (in_size > 0 || written == sizeof(out));
 }
 
 static void
-on_request_finished(SoupMessage *msg, gpointer user_data)
+on_request_got_chunk(SoupMessage *msg, SoupBuffer *chunk, gpointer user_data)
 {
-  SoupURI *uri = soup_message_get_uri(msg);
+  FbHttpRequest *req = user_data;
+  FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(req);
+  const gchar *in = chunk->data;
+  gsize in_size = chunk->length;
 
-  g_print("%s %s HTTP/1.1\n", msg->method, soup_uri_to_string(uri, FALSE));
+  priv->wire_size += chunk->length;
 
-  fb_util_debug_info("%s Response (%p): %s %s (%d)", msg->method, user_data,
-                     soup_uri_to_string(uri, FALSE),
-                     soup_status_get_phrase(msg->status_code),
-                     msg->status_code );
+  if (!priv->decoder)
+  {
+    fb_http_request_deliver(req, in, in_size);
+    return;
+  }
 
-  _print_headers(msg->response_headers);
-  _print_body(msg->response_body, FALSE);
+  if (!priv->decoded)
+    fb_http_request_decode(req, in, in_size, G_CONVERTER_NO_FLAGS);
 }
 
 static void
@@ -185,8 +442,12 @@ fb_http_request_disconnect_signals(FbHttpRequest *req)
 
   g_assert(priv->msg);
 
+  g_signal_handlers_disconnect_by_func(priv->msg, on_request_network_event,
+                                       req);
   g_signal_handlers_disconnect_by_func(priv->msg, on_request_starting, req);
-  g_signal_handlers_disconnect_by_func(priv->msg, on_request_finished, req);
+  g_signal_handlers_disconnect_by_func(priv->msg, on_request_got_headers,
+                                       req);
+  g_signal_handlers_disconnect_by_func(priv->msg, on_request_got_chunk, req);
 }
 
 static void
@@ -220,6 +481,18 @@ fb_http_request_dispose(GObject *object)
       priv->url = NULL;
     }
 
+    g_clear_object(&priv->decoder);
+    g_clear_object(&priv->cancellable);
+    g_clear_pointer(&priv->trace, fb_http_trace_record_free);
+
+    if (priv->body)
+    {
+      g_byte_array_unref(priv->body);
+      priv->body = NULL;
+    }
+
+    g_clear_pointer(&priv->bytes, g_bytes_unref);
+
     G_OBJECT_CLASS(fb_http_request_parent_class)->dispose(object);
 }
 
@@ -236,6 +509,56 @@ fb_http_request_init(FbHttpRequest *req)
 
   priv->headers = fb_http_values_new();
   priv->params = fb_http_values_new();
+  priv->body = g_byte_array_new();
+  priv->priority = FB_HTTP_PRIORITY_INTERACTIVE;
+  priv->link.data = req;
+  priv->timeout = FB_HTTP_REQUEST_TIMEOUT;
+}
+
+/* FACEBOOK_API_SERVER=scheme://host:port sends every request there instead,
+ * path and query unchanged, see tools/fb-mock-server */
+static gchar *
+fb_http_url_override(const gchar *url)
+{
+  static SoupURI *server = NULL;
+  static gboolean checked = FALSE;
+  SoupURI *uri;
+  gchar *ret;
+
+  if (G_UNLIKELY(!checked))
+  {
+    const gchar *env = g_getenv("FACEBOOK_API_SERVER");
+
+    if (env && *env)
+      server = soup_uri_new(env);
+
+    checked = TRUE;
+  }
+
+  if (G_LIKELY(!server) || !(uri = soup_uri_new(url)))
+    return g_strdup(url);
+
+  soup_uri_set_scheme(uri, server->scheme);
+  soup_uri_set_host(uri, server->host);
+  soup_uri_set_port(uri, server->port);
+  ret = soup_uri_to_string(uri, FALSE);
+  soup_uri_free(uri);
+
+  return ret;
+}
+
+static gboolean
+fb_http_url_listed(GSList *urls, const gchar *url)
+{
+  GSList *l;
+
+  for (l = urls; l; l = l->next)
+  {
+    if (fb_http_urlcmp(url, l->data, TRUE))
+      return TRUE;
+  }
+
+  return FALSE;
 }
 
 FbHttpRequest *
@@ -244,33 +567,24 @@ fb_http_request_new(FbHttp *http, const gchar *url, gboolean post,
 {
   FbHttpRequest *req = g_object_new(FB_TYPE_HTTP_REQUEST, NULL);
   FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(req);
-  static gboolean debug_enabled = FALSE;
-  static gboolean debug_inited = FALSE;
-
-  if (G_UNLIKELY(!debug_inited))
-  {
-    debug_enabled = (g_getenv("BITLBEE_DEBUG")) ||
-        (g_getenv("BITLBEE_DEBUG_FACEBOOK"));
-    debug_inited = TRUE;
-  }
-
   g_return_if_fail(http != NULL);
   g_return_if_fail(url != NULL);
 
   priv->http = g_object_ref(http);
   priv->func = func;
   priv->data = data;
-  priv->msg = soup_message_new(post ? SOUP_METHOD_POST : SOUP_METHOD_GET, url);
-  priv->url = g_strdup(url);
+  priv->url = fb_http_url_override(url);
+  priv->msg = soup_message_new(post ? SOUP_METHOD_POST : SOUP_METHOD_GET,
+                               priv->url);
   priv->post = post;
+  priv->idempotent = !post || fb_http_url_listed(fb_http_idempotent_urls,
+                                                 url);
 
-  if (debug_enabled)
-  {
-    g_signal_connect(priv->msg, "starting",
-                     G_CALLBACK(on_request_starting), req);
-    g_signal_connect(priv->msg, "finished",
-                     G_CALLBACK(on_request_finished), req);
-  }
+  if (fb_http_url_listed(fb_http_critical_urls, url))
+    priv->priority = FB_HTTP_PRIORITY_CRITICAL;
+
+  if (fb_http_cancellables)
+    priv->cancellable = g_object_ref(fb_http_cancellables->data);
 
   return req;
 }
@@ -279,14 +593,54 @@ const gchar *
 fb_http_request_get_data(FbHttpRequest *req, gsize *size)
 {
   FbHttpRequestPrivate *priv;
-  GBytes *bytes;
 
   g_return_val_if_fail(FB_IS_HTTP_REQUEST(req), (*size = 0, NULL));
 
   priv = FB_HTTP_REQUEST_PRIVATE(req);
-  g_object_get(priv->msg, SOUP_MESSAGE_RESPONSE_BODY_DATA, &bytes, NULL);
 
-  return g_bytes_get_data(bytes, size);
+  if (priv->bytes)
+  {
+    gsize len;
+    gconstpointer data = g_bytes_get_data(priv->bytes, &len);
+
+    /* leave out the terminator */
+    len--;
+
+    if (size)
+      *size = len;
+
+    return len ? data : NULL;
+  }
+
+  if (size)
+    *size = priv->body ? priv->body->len : 0;
+
+  return priv->body && priv->body->len ? (const gchar *)priv->body->data :
+                                         NULL;
+}
+
+GBytes *
+fb_http_request_take_bytes(FbHttpRequest *req)
+{
+  FbHttpRequestPrivate *priv;
+  GByteArray *array;
+  GBytes *bytes;
+
+  g_return_val_if_fail(FB_IS_HTTP_REQUEST(req), NULL);
+
+  priv = FB_HTTP_REQUEST_PRIVATE(req);
+
+  if (!(bytes = priv->bytes))
+    return NULL;
+
+  priv->bytes = NULL;
+
+  /* we hold the only reference, so this just drops the terminator, the
+   * data stays where it is */
+  array = g_bytes_unref_to_array(bytes);
+  g_byte_array_set_size(array, array->len - 1);
+
+  return g_byte_array_free_to_bytes(array);
 }
 
 FbHttpValues *
@@ -305,13 +659,327 @@ fb_http_request_get_params(FbHttpRequest *req)
     return FB_HTTP_REQUEST_PRIVATE(req)->params;
 }
 
+static gint64
+fb_http_phase(gint64 start, gint64 end)
+{
+  return start && end ? end - start : -1;
+}
+
 static void
-fb_http_request_cb(SoupSession *session, SoupMessage *msg, gpointer user_data)
+fb_http_request_add_stats(FbHttpRequestPrivate *priv)
+{
+  gint64 durations[FB_HTTP_PHASE_N];
+  gint64 acquired;
+  gchar *url;
+
+  /* whatever happened first once the session picked the message up */
+  acquired = priv->resolving ? priv->resolving :
+      priv->connecting ? priv->connecting : priv->starting;
+
+  durations[FB_HTTP_PHASE_QUEUE] = fb_http_phase(priv->queued, acquired);
+  durations[FB_HTTP_PHASE_DNS] = fb_http_phase(priv->resolving,
+                                               priv->resolved);
+  durations[FB_HTTP_PHASE_CONNECT] = fb_http_phase(priv->connecting,
+                                                   priv->connected);
+  durations[FB_HTTP_PHASE_TLS] = fb_http_phase(priv->handshaking,
+                                               priv->handshaked);
+  durations[FB_HTTP_PHASE_WAIT] = fb_http_phase(priv->starting,
+                                                priv->first_byte);
+  durations[FB_HTTP_PHASE_TOTAL] = fb_http_phase(priv->queued,
+                                                 g_get_monotonic_time());
+
+  url = soup_uri_to_string(soup_message_get_uri(priv->msg), FALSE);
+  fb_http_stats_add(url, durations);
+  g_free(url);
+}
+
+static void
+fb_http_request_cb(SoupSession *session, SoupMessage *msg,
+                   gpointer user_data);
+
+static void
+fb_http_scheduler_dispatch(void)
+{
+  FbHttpScheduler *sched = &fb_http_scheduler;
+
+  for (guint i = 0; i < FB_HTTP_PRIORITY_N; i++)
+  {
+    while (sched->total < FB_HTTP_MAX_CONNS &&
+           sched->active[i] < fb_http_class_max[i] &&
+           !g_queue_is_empty(&sched->pending[i]))
+    {
+      GList *link = g_queue_pop_head_link(&sched->pending[i]);
+      FbHttpRequest *req = link->data;
+      FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(req);
+
+      sched->active[i]++;
+      sched->total++;
+      priv->pending = FALSE;
+      priv->dispatched = TRUE;
+      priv->attempts++;
+      soup_session_queue_message(FB_HTTP_PRIVATE(priv->http)->session,
+                                 priv->msg, fb_http_request_cb, req);
+    }
+
+    /* lower classes wait while a higher one still has a backlog */
+    if (!g_queue_is_empty(&sched->pending[i]))
+      break;
+  }
+}
+
+static void
+fb_http_request_enqueue(FbHttpRequest *req)
+{
+  FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(req);
+
+  priv->queued = g_get_monotonic_time();
+  priv->pending = TRUE;
+  g_queue_push_tail_link(&fb_http_scheduler.pending[priv->priority],
+                         &priv->link);
+}
+
+static FbHttpBreaker *
+fb_http_breaker_get(SoupMessage *msg)
+{
+  const gchar *host = soup_message_get_uri(msg)->host;
+  FbHttpBreaker *breaker;
+
+  if (G_UNLIKELY(!fb_http_breakers))
+  {
+    fb_http_breakers = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             g_free, g_free);
+  }
+
+  breaker = g_hash_table_lookup(fb_http_breakers, host);
+
+  if (!breaker)
+  {
+    breaker = g_new0(FbHttpBreaker, 1);
+    g_hash_table_insert(fb_http_breakers, g_strdup(host), breaker);
+  }
+
+  return breaker;
+}
+
+static gboolean
+fb_http_breaker_is_open(FbHttpBreaker *breaker)
+{
+  return breaker->failures >= FB_HTTP_BREAKER_THRESHOLD;
+}
+
+/* FALSE while @req has to fail without trying */
+static gboolean
+fb_http_breaker_allow(FbHttpRequest *req)
+{
+  FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(req);
+  FbHttpBreaker *breaker = fb_http_breaker_get(priv->msg);
+
+  if (!fb_http_breaker_is_open(breaker))
+    return TRUE;
+
+  if (breaker->probing || g_get_monotonic_time() < breaker->open_until)
+    return FALSE;
+
+  /* half open, a single request finds out if the host is back */
+  breaker->probing = TRUE;
+  priv->probe = TRUE;
+
+  return TRUE;
+}
+
+static void
+fb_http_breaker_record(FbHttpRequest *req, gboolean failed)
+{
+  FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(req);
+  FbHttpBreaker *breaker = fb_http_breaker_get(priv->msg);
+
+  if (priv->probe)
+  {
+    breaker->probing = FALSE;
+    priv->probe = FALSE;
+  }
+
+  if (!failed)
+  {
+    breaker->failures = 0;
+    return;
+  }
+
+  if (++breaker->failures >= FB_HTTP_BREAKER_THRESHOLD)
+  {
+    breaker->open_until = g_get_monotonic_time() +
+        FB_HTTP_BREAKER_OPEN * G_USEC_PER_SEC;
+  }
+}
+
+/* failures that may well be gone on the next attempt */
+static gboolean
+fb_http_status_transient(guint status)
+{
+  switch (status)
+  {
+    case SOUP_STATUS_CANT_RESOLVE:
+    case SOUP_STATUS_CANT_CONNECT:
+    case SOUP_STATUS_IO_ERROR:
+    case SOUP_STATUS_TRY_AGAIN:
+    case SOUP_STATUS_REQUEST_TIMEOUT:
+    case FB_HTTP_STATUS_TOO_MANY_REQUESTS:
+    case SOUP_STATUS_INTERNAL_SERVER_ERROR:
+    case SOUP_STATUS_BAD_GATEWAY:
+    case SOUP_STATUS_SERVICE_UNAVAILABLE:
+    case SOUP_STATUS_GATEWAY_TIMEOUT:
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
+guint
+fb_http_get_backlog(FbHttpPriority priority)
+{
+  guint backlog = 0;
+
+  g_return_val_if_fail(priority < FB_HTTP_PRIORITY_N, 0);
+
+  for (guint i = 0; i <= priority; i++)
+  {
+    backlog += fb_http_scheduler.active[i] +
+        g_queue_get_length(&fb_http_scheduler.pending[i]);
+  }
+
+  return backlog;
+}
+
+gboolean
+fb_http_error_is_transient(const GError *error)
+{
+  if (!error)
+    return FALSE;
+
+  if (error->domain == FB_HTTP_ERROR)
+    return fb_http_status_transient(error->code);
+
+  return g_error_matches(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT) ||
+      g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+}
+
+/* the server never acted on the request, so any request can be repeated */
+static gboolean
+fb_http_status_unprocessed(guint status)
+{
+  return status == SOUP_STATUS_CANT_RESOLVE ||
+      status == SOUP_STATUS_CANT_CONNECT ||
+      status == FB_HTTP_STATUS_TOO_MANY_REQUESTS ||
+      status == SOUP_STATUS_SERVICE_UNAVAILABLE;
+}
+
+/* seconds, or -1 if @value is neither delay seconds nor an HTTP date */
+static gint64
+fb_http_parse_retry_after(const gchar *value)
+{
+  gchar *end;
+  guint64 seconds = g_ascii_strtoull(value, &end, 10);
+  SoupDate *date;
+  gint64 when;
+
+  if (end != value && *end == '\0')
+    return MIN(seconds, G_MAXINT);
+
+  date = soup_date_new_from_string(value);
+
+  if (!date)
+    return -1;
+
+  when = soup_date_to_time_t(date);
+  soup_date_free(date);
+
+  return MAX(when - g_get_real_time() / G_USEC_PER_SEC, 0);
+}
+
+/* microseconds until the next attempt, or -1 if @req is done */
+static gint64
+fb_http_request_retry_delay(FbHttpRequest *req)
+{
+  FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(req);
+  guint status = priv->msg->status_code;
+  const gchar *value;
+  gint64 retry_after = -1;
+  gint64 delay;
+
+  /* streamed chunks can't be taken back */
+  if (priv->aborted || priv->error || priv->streaming ||
+      priv->attempts >= FB_HTTP_RETRY_ATTEMPTS ||
+      !fb_http_status_transient(status))
+  {
+    return -1;
+  }
+
+  if (!priv->idempotent && !fb_http_status_unprocessed(status))
+    return -1;
+
+  if (fb_http_breaker_is_open(fb_http_breaker_get(priv->msg)))
+    return -1;
+
+  value = soup_message_headers_get_one(priv->msg->response_headers,
+                                       "Retry-After");
+
+  if (value)
+    retry_after = fb_http_parse_retry_after(value);
+
+  if (retry_after >= 0)
+  {
+    /* the server knows best, unless it wants us gone for too long */
+    if (retry_after > FB_HTTP_RETRY_AFTER_MAX)
+      return -1;
+
+    delay = retry_after * G_USEC_PER_SEC;
+  }
+  else
+  {
+    /* full jitter, clients that failed together don't come back together */
+    gint32 cap = MIN(FB_HTTP_RETRY_CAP,
+                     FB_HTTP_RETRY_BASE << (priv->attempts - 1));
+
+    delay = (gint64)g_random_int_range(0, cap + 1) * 1000;
+  }
+
+  if (priv->deadline && g_get_monotonic_time() + delay >= priv->deadline)
+    return -1;
+
+  return delay;
+}
+
+/* runs the callback and drops the reference fb_http_request_send() took
+ * over from fb_http_request_new() */
+static void
+fb_http_request_complete(FbHttpRequest *req)
 {
-  FbHttpRequest *req = FB_HTTP_REQUEST(user_data);
   FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(req);
+  SoupMessage *msg = priv->msg;
+
+  priv->done = TRUE;
 
-  if (G_UNLIKELY(msg->status_code != 200))
+  if (priv->timeout_id)
+  {
+    g_source_remove(priv->timeout_id);
+    priv->timeout_id = 0;
+  }
+
+  if (priv->cancelled_id)
+  {
+    g_signal_handler_disconnect(priv->cancellable, priv->cancelled_id);
+    priv->cancelled_id = 0;
+  }
+
+  /* aborted before it could tell how the host is doing */
+  if (priv->probe)
+  {
+    fb_http_breaker_get(msg)->probing = FALSE;
+    priv->probe = FALSE;
+  }
+
+  if (G_UNLIKELY(msg->status_code != 200) &&
+      !fb_http_request_not_modified(req) && !priv->error)
   {
     guint code = priv->msg->status_code;
     const gchar *status = soup_status_get_phrase(code);
@@ -320,56 +988,358 @@ fb_http_request_cb(SoupSession *session, SoupMessage *msg, gpointer user_data)
                 "%s", status);
   }
 
+  /* get out what zlib still holds, and make sure the stream was whole,
+   * bodiless responses may come with a Content-Encoding all the same */
+  if (priv->decoder && !priv->decoded && priv->wire_size &&
+      msg->status_code != SOUP_STATUS_CANCELLED)
+  {
+    fb_http_request_decode(req, "", 0, G_CONVERTER_INPUT_AT_END);
+
+    if (!priv->decoded && !priv->error)
+    {
+      g_set_error(&priv->error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                  "Truncated %s response body",
+                  soup_message_headers_get_one(msg->response_headers,
+                                               "Content-Encoding"));
+    }
+  }
+
+  g_clear_object(&priv->decoder);
+
   fb_http_request_disconnect_signals(req);
 
+  if (msg->status_code != SOUP_STATUS_CANCELLED)
+    fb_http_request_add_stats(priv);
+
+  if (G_UNLIKELY(priv->trace))
+  {
+    fb_http_trace_end(priv->trace, msg->status_code, priv->wire_size,
+                      priv->body->data, priv->body->len);
+    priv->trace = NULL;
+  }
+
+  if (G_UNLIKELY(fb_capture_enabled()) &&
+      msg->status_code != SOUP_STATUS_CANCELLED)
+  {
+    gchar *url = soup_uri_to_string(soup_message_get_uri(msg), FALSE);
+    SoupBuffer *request = soup_message_body_flatten(msg->request_body);
+
+    fb_capture_http(msg->method, url, request->data, request->length,
+                    msg->status_code, priv->body->data, priv->body->len,
+                    g_get_monotonic_time() - priv->queued);
+    soup_buffer_free(request);
+    g_free(url);
+  }
+
+  /* FbApi reads bodies as strings, so terminate them like SoupMessageBody
+   * did, the '\0' is not part of the reported size */
+  g_byte_array_append(priv->body, (const guint8 *)"", 1);
+  priv->bytes = g_byte_array_free_to_bytes(priv->body);
+  priv->body = NULL;
+
+  /* requests the callback makes belong to the same owner */
   if (G_LIKELY(priv->func != NULL))
-      priv->func(req, priv->data);
+  {
+    fb_http_push_cancellable(priv->cancellable);
+    priv->func(req, priv->data);
+    fb_http_pop_cancellable();
+  }
+
+  /* the session owns the message once it got it */
+  if (!priv->dispatched)
+    g_object_unref(priv->msg);
 
   priv->msg = NULL;
   g_object_unref(req);
 }
 
-void
-fb_http_request_send(FbHttpRequest *req)
+static void
+fb_http_request_prepare(FbHttpRequest *req);
+
+static gboolean
+fb_http_request_retry_cb(gpointer user_data)
 {
-    FbHttpRequestPrivate *priv;
+  FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(user_data);
+
+  priv->retry_id = 0;
+  fb_http_request_enqueue(user_data);
+  fb_http_scheduler_dispatch();
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+fb_http_request_retry(FbHttpRequest *req, gint64 delay)
+{
+  FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(req);
+
+  /* the failed attempt took its time on the wire all the same */
+  fb_http_request_add_stats(priv);
+  fb_http_request_disconnect_signals(req);
+
+  /* the session drops the old message once we return, and libsoup can't
+   * send a message twice anyway, so the next attempt gets a copy */
+  priv->msg = soup_message_new(priv->post ? SOUP_METHOD_POST : SOUP_METHOD_GET,
+                               priv->url);
+  priv->dispatched = FALSE;
+  fb_http_request_prepare(req);
+
+  g_byte_array_set_size(priv->body, 0);
+  g_clear_object(&priv->decoder);
+  priv->decoded = FALSE;
+  priv->wire_size = 0;
+  priv->body_size = 0;
+  priv->resolving = 0;
+  priv->resolved = 0;
+  priv->connecting = 0;
+  priv->connected = 0;
+  priv->handshaking = 0;
+  priv->handshaked = 0;
+  priv->starting = 0;
+  priv->first_byte = 0;
+
+  priv->retry_id = g_timeout_add(delay / 1000, fb_http_request_retry_cb, req);
+}
+
+static void
+fb_http_request_cb(SoupSession *session, SoupMessage *msg, gpointer user_data)
+{
+  FbHttpRequest *req = user_data;
+  FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(req);
+  gint64 delay;
+
+  fb_http_scheduler.active[priv->priority]--;
+  fb_http_scheduler.total--;
+
+  if (msg->status_code != SOUP_STATUS_CANCELLED)
+    fb_http_breaker_record(req, fb_http_status_transient(msg->status_code));
+
+  delay = fb_http_request_retry_delay(req);
+
+  if (delay >= 0)
+    fb_http_request_retry(req, delay);
+  else
+    fb_http_request_complete(req);
+
+  fb_http_scheduler_dispatch();
+}
+
+/* takes @error */
+static void
+fb_http_request_abort(FbHttpRequest *req, GError *error)
+{
+  FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(req);
+
+  if (priv->done || priv->aborted)
+  {
+    g_error_free(error);
+    return;
+  }
+
+  priv->aborted = TRUE;
+
+  /* a decoding error came first */
+  if (priv->error)
+    g_error_free(error);
+  else
+    priv->error = error;
+
+  if (priv->dispatched)
+  {
+    soup_session_cancel_message(FB_HTTP_PRIVATE(priv->http)->session,
+                                priv->msg, SOUP_STATUS_CANCELLED);
+    return;
+  }
+
+  if (priv->retry_id)
+  {
+    g_source_remove(priv->retry_id);
+    priv->retry_id = 0;
+  }
+
+  if (priv->pending)
+  {
+    g_queue_unlink(&fb_http_scheduler.pending[priv->priority], &priv->link);
+    priv->pending = FALSE;
+  }
+
+  soup_message_set_status(priv->msg, SOUP_STATUS_CANCELLED);
+  fb_http_request_complete(req);
+}
+
+static void
+fb_http_request_cancelled_cb(GCancellable *cancellable, gpointer user_data)
+{
+  fb_http_request_abort(user_data,
+                        g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                            "Request cancelled"));
+}
+
+static gboolean
+fb_http_request_cancelled_idle(gpointer user_data)
+{
+  fb_http_request_cancelled_cb(NULL, user_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+fb_http_request_timeout_cb(gpointer user_data)
+{
+  FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(user_data);
+
+  priv->timeout_id = 0;
+  fb_http_request_abort(user_data,
+                        g_error_new_literal(G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                                            "Request timed out"));
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+fb_http_request_rejected_cb(gpointer user_data)
+{
+  FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(user_data);
+  const gchar *host = soup_message_get_uri(priv->msg)->host;
+
+  priv->retry_id = 0;
+  fb_http_request_abort(user_data,
+                        g_error_new(FB_HTTP_ERROR,
+                                    SOUP_STATUS_SERVICE_UNAVAILABLE,
+                                    "%s keeps failing, try again later",
+                                    host));
+
+  return G_SOURCE_REMOVE;
+}
+
+/* builds the message from the request, again for every attempt */
+static void
+fb_http_request_prepare(FbHttpRequest *req)
+{
+    FbHttpRequestPrivate *priv = FB_HTTP_REQUEST_PRIVATE(req);
     GHashTableIter iter;
     gpointer key;
     gpointer val;
     SoupMessageHeaders *hdrs;
-    gchar *query = NULL;
 
-    g_return_if_fail(FB_IS_HTTP_REQUEST(req));
+    g_object_get(priv->msg, SOUP_MESSAGE_REQUEST_HEADERS, &hdrs, NULL);
 
-    priv = FB_HTTP_REQUEST_PRIVATE(req);
+    if (FB_HTTP_PRIVATE(priv->http)->agent &&
+        !g_hash_table_contains(priv->headers, "User-Agent"))
+    {
+      soup_message_headers_replace(hdrs, "User-Agent",
+                                   FB_HTTP_PRIVATE(priv->http)->agent);
+    }
 
-    g_object_get(priv->msg, SOUP_MESSAGE_REQUEST_HEADERS, &hdrs, NULL);
     g_hash_table_iter_init(&iter, priv->headers);
 
     while (g_hash_table_iter_next(&iter, &key, &val))
       soup_message_headers_append(hdrs, key, val);
 
-    if (g_hash_table_size(priv->params))
-      query = soup_form_encode_hash(priv->params);
-
+    /* encoded straight into the buffer that becomes the body or URI */
     if (priv->post)
     {
+      GString *body = g_string_sized_new(256);
+      gsize len;
+
+      fb_http_values_encode(priv->params, body);
+      len = body->len;
       soup_message_set_request(priv->msg, "application/x-www-form-urlencoded",
-                               SOUP_MEMORY_TAKE, query, strlen(query));
+                               SOUP_MEMORY_TAKE, g_string_free(body, FALSE),
+                               len);
     }
-    else if (query)
+    else if (g_hash_table_size(priv->params))
     {
-      gchar *url = g_strdup_printf("%s?%s", priv->url, query);
-      SoupURI *uri = soup_uri_new(url);
+      GString *url = g_string_sized_new(256);
+      SoupURI *uri;
+
+      g_string_append(url, priv->url);
+      g_string_append_c(url, '?');
+      fb_http_values_encode(priv->params, url);
+      uri = soup_uri_new(url->str);
 
       g_object_set(priv->msg, SOUP_MESSAGE_URI, uri, NULL);
       soup_uri_free(uri);
+      g_string_free(url, TRUE);
+    }
+
+    if (!g_hash_table_contains(priv->headers, "Accept-Encoding"))
+    {
+      soup_message_headers_replace(hdrs, "Accept-Encoding",
+                                   FB_HTTP_ACCEPT_ENCODING);
+    }
+
+    /* the body is decoded and collected by the handlers below */
+    soup_message_disable_feature(priv->msg, SOUP_TYPE_CONTENT_DECODER);
+    soup_message_body_set_accumulate(priv->msg->response_body, FALSE);
+    g_signal_connect(priv->msg, "got-headers",
+                     G_CALLBACK(on_request_got_headers), req);
+    g_signal_connect(priv->msg, "got-chunk",
+                     G_CALLBACK(on_request_got_chunk), req);
+    g_signal_connect(priv->msg, "network-event",
+                     G_CALLBACK(on_request_network_event), req);
+    g_signal_connect(priv->msg, "starting",
+                     G_CALLBACK(on_request_starting), req);
+
+    soup_message_set_priority(priv->msg,
+                              fb_http_class_soup_priority[priv->priority]);
+}
+
+void
+fb_http_request_send(FbHttpRequest *req)
+{
+    FbHttpRequestPrivate *priv;
+
+    g_return_if_fail(FB_IS_HTTP_REQUEST(req));
+
+    priv = FB_HTTP_REQUEST_PRIVATE(req);
+
+    fb_http_request_prepare(req);
+
+    if (G_UNLIKELY(fb_http_trace_enabled()))
+    {
+      gchar *url = soup_uri_to_string(soup_message_get_uri(priv->msg), FALSE);
+      SoupBuffer *body = soup_message_body_flatten(priv->msg->request_body);
+
+      priv->trace = fb_http_trace_begin(priv->msg->method, url, body->data,
+                                        body->length);
+      soup_buffer_free(body);
       g_free(url);
-      g_free(query);
     }
 
-    soup_session_queue_message(FB_HTTP_PRIVATE(priv->http)->session,
-                               priv->msg, fb_http_request_cb, req);
+    if (priv->cancellable)
+    {
+      /* callers don't expect the callback before send returns, and the
+       * request must not go out at all */
+      if (g_cancellable_is_cancelled(priv->cancellable))
+      {
+        g_idle_add_full(G_PRIORITY_DEFAULT, fb_http_request_cancelled_idle,
+                        g_object_ref(req), g_object_unref);
+        return;
+      }
+
+      priv->cancelled_id = g_signal_connect(
+        priv->cancellable, "cancelled",
+        G_CALLBACK(fb_http_request_cancelled_cb), req);
+    }
+
+    if (priv->timeout)
+    {
+      priv->deadline = g_get_monotonic_time() +
+          priv->timeout * G_USEC_PER_SEC;
+      priv->timeout_id = g_timeout_add_seconds(
+        priv->timeout, fb_http_request_timeout_cb, req);
+    }
+
+    if (!fb_http_breaker_allow(req))
+    {
+      /* same as for cancellation, no callback before send returns */
+      priv->retry_id = g_idle_add(fb_http_request_rejected_cb, req);
+      return;
+    }
+
+    fb_http_request_enqueue(req);
+    fb_http_scheduler_dispatch();
 }
 
 const gchar *
@@ -411,6 +1381,196 @@ fb_http_request_take_error(FbHttpRequest *req)
     return err;
 }
 
+void
+fb_http_push_cancellable(GCancellable *cancellable)
+{
+  fb_http_cancellables = g_slist_prepend(
+    fb_http_cancellables, cancellable ? g_object_ref(cancellable) : NULL);
+}
+
+void
+fb_http_pop_cancellable(void)
+{
+  g_return_if_fail(fb_http_cancellables != NULL);
+
+  if (fb_http_cancellables->data)
+    g_object_unref(fb_http_cancellables->data);
+
+  fb_http_cancellables = g_slist_delete_link(fb_http_cancellables,
+                                             fb_http_cancellables);
+}
+
+void
+fb_http_request_set_cancellable(FbHttpRequest *req,
+                                GCancellable *cancellable)
+{
+  FbHttpRequestPrivate *priv;
+
+  g_return_if_fail(FB_IS_HTTP_REQUEST(req));
+
+  priv = FB_HTTP_REQUEST_PRIVATE(req);
+
+  if (cancellable)
+    g_object_ref(cancellable);
+
+  g_clear_object(&priv->cancellable);
+  priv->cancellable = cancellable;
+}
+
+void
+fb_http_request_set_timeout(FbHttpRequest *req, guint seconds)
+{
+  g_return_if_fail(FB_IS_HTTP_REQUEST(req));
+
+  FB_HTTP_REQUEST_PRIVATE(req)->timeout = seconds;
+}
+
+void
+fb_http_request_set_idempotent(FbHttpRequest *req, gboolean idempotent)
+{
+  g_return_if_fail(FB_IS_HTTP_REQUEST(req));
+
+  FB_HTTP_REQUEST_PRIVATE(req)->idempotent = idempotent;
+}
+
+void
+fb_http_add_idempotent_url(const gchar *url)
+{
+  g_return_if_fail(url != NULL);
+
+  if (g_slist_find_custom(fb_http_idempotent_urls, url,
+                          (GCompareFunc)g_strcmp0))
+  {
+    return;
+  }
+
+  fb_http_idempotent_urls = g_slist_prepend(fb_http_idempotent_urls,
+                                            g_strdup(url));
+}
+
+void
+fb_http_add_critical_url(const gchar *url)
+{
+  g_return_if_fail(url != NULL);
+
+  if (g_slist_find_custom(fb_http_critical_urls, url,
+                          (GCompareFunc)g_strcmp0))
+  {
+    return;
+  }
+
+  fb_http_critical_urls = g_slist_prepend(fb_http_critical_urls,
+                                          g_strdup(url));
+}
+
+void
+fb_http_request_set_priority(FbHttpRequest *req, FbHttpPriority priority)
+{
+  g_return_if_fail(FB_IS_HTTP_REQUEST(req));
+  g_return_if_fail(priority < FB_HTTP_PRIORITY_N);
+
+  FB_HTTP_REQUEST_PRIVATE(req)->priority = priority;
+}
+
+void
+fb_http_request_set_validators(FbHttpRequest *req, const gchar *etag,
+                               const gchar *last_modified)
+{
+  FbHttpRequestPrivate *priv;
+
+  g_return_if_fail(FB_IS_HTTP_REQUEST(req));
+
+  priv = FB_HTTP_REQUEST_PRIVATE(req);
+
+  if (etag)
+  {
+    g_hash_table_replace(priv->headers, g_strdup("If-None-Match"),
+                         g_strdup(etag));
+    priv->conditional = TRUE;
+  }
+
+  if (last_modified)
+  {
+    g_hash_table_replace(priv->headers, g_strdup("If-Modified-Since"),
+                         g_strdup(last_modified));
+    priv->conditional = TRUE;
+  }
+}
+
+void
+fb_http_request_set_chunk_func(FbHttpRequest *req, FbHttpChunkFunc func,
+                               gpointer user_data)
+{
+  FbHttpRequestPrivate *priv;
+
+  g_return_if_fail(FB_IS_HTTP_REQUEST(req));
+
+  priv = FB_HTTP_REQUEST_PRIVATE(req);
+  priv->chunk_func = func;
+  priv->chunk_data = user_data;
+}
+
+void
+fb_http_request_get_sizes(FbHttpRequest *req, gsize *wire_size,
+                          gsize *body_size)
+{
+  FbHttpRequestPrivate *priv;
+
+  g_return_if_fail(FB_IS_HTTP_REQUEST(req));
+
+  priv = FB_HTTP_REQUEST_PRIVATE(req);
+
+  if (wire_size)
+    *wire_size = priv->wire_size;
+
+  if (body_size)
+    *body_size = priv->body_size;
+}
+
+gboolean
+fb_http_request_not_modified(FbHttpRequest *req)
+{
+  FbHttpRequestPrivate *priv;
+
+  g_return_val_if_fail(FB_IS_HTTP_REQUEST(req), FALSE);
+
+  priv = FB_HTTP_REQUEST_PRIVATE(req);
+
+  return priv->conditional && priv->msg &&
+      priv->msg->status_code == SOUP_STATUS_NOT_MODIFIED;
+}
+
+const gchar *
+fb_http_request_get_etag(FbHttpRequest *req)
+{
+  FbHttpRequestPrivate *priv;
+
+  g_return_val_if_fail(FB_IS_HTTP_REQUEST(req), NULL);
+
+  priv = FB_HTTP_REQUEST_PRIVATE(req);
+
+  if (!priv->msg)
+    return NULL;
+
+  return soup_message_headers_get_one(priv->msg->response_headers, "ETag");
+}
+
+const gchar *
+fb_http_request_get_last_modified(FbHttpRequest *req)
+{
+  FbHttpRequestPrivate *priv;
+
+  g_return_val_if_fail(FB_IS_HTTP_REQUEST(req), NULL);
+
+  priv = FB_HTTP_REQUEST_PRIVATE(req);
+
+  if (!priv->msg)
+    return NULL;
+
+  return soup_message_headers_get_one(priv->msg->response_headers,
+                                      "Last-Modified");
+}
+
 gboolean
 fb_http_urlcmp(const gchar *url1, const gchar *url2, gboolean protocol)
 {
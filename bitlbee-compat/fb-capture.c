@@ -0,0 +1,461 @@
+/*
+ * This file is part of telepathy-facebook
+ *
+ * Copyright (C) 2025 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <json-glib/json-glib.h>
+
+#include "fb-capture.h"
+
+/* kind, time and size */
+#define FB_CAPTURE_HEADER_SIZE 13
+
+#define FB_CAPTURE_MQTT_CONNECT 1
+
+/* form fields and JSON members that never go into a capture */
+static const gchar *secrets[] =
+{
+  "access_token", "password", "sig", "secret", "session_key",
+  "session_cookies", "credentials", "email", "machine_id", NULL
+};
+
+struct _FbCapture
+{
+  FILE *file;
+  gint64 start;
+};
+
+typedef struct _FbCapture FbCapture;
+
+struct _FbCaptureReader
+{
+  GMappedFile *file;
+  GBytes *bytes;
+  gsize pos;
+};
+
+static FbCapture *
+fb_capture_get(void)
+{
+  static FbCapture capture;
+  static gboolean inited = FALSE;
+  const gchar *env;
+  int fd;
+
+  if (G_LIKELY(inited))
+    return capture.file ? &capture : NULL;
+
+  inited = TRUE;
+
+  if (!(env = g_getenv("FACEBOOK_CAPTURE")) || !*env)
+    return NULL;
+
+  /* account traffic, for nobody else to read */
+  if ((fd = open(env, O_CREAT | O_TRUNC | O_WRONLY, 0600)) < 0 ||
+      !(capture.file = fdopen(fd, "wb")))
+  {
+    g_warning("Can't write capture to %s", env);
+
+    if (fd >= 0)
+      close(fd);
+
+    return NULL;
+  }
+
+  fwrite(FB_CAPTURE_MAGIC, 1, strlen(FB_CAPTURE_MAGIC), capture.file);
+  capture.start = g_get_monotonic_time();
+
+  return &capture;
+}
+
+gboolean
+fb_capture_enabled(void)
+{
+  return fb_capture_get() != NULL;
+}
+
+static gboolean
+fb_capture_is_secret(const gchar *name, gsize len)
+{
+  const gchar **secret;
+
+  for (secret = secrets; *secret; secret++)
+  {
+    if (strlen(*secret) == len && !g_ascii_strncasecmp(*secret, name, len))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* appends @form with the values of secret fields left empty */
+static void
+fb_capture_append_form(GString *str, const gchar *form, gsize size)
+{
+  const gchar *end = form + size;
+  const gchar *p = form;
+
+  while (p < end)
+  {
+    const gchar *amp = memchr(p, '&', end - p);
+    const gchar *eq;
+
+    if (!amp)
+      amp = end;
+
+    eq = memchr(p, '=', amp - p);
+
+    if (eq && fb_capture_is_secret(p, eq - p))
+      g_string_append_len(str, p, eq + 1 - p);
+    else
+      g_string_append_len(str, p, amp - p);
+
+    if (amp < end)
+      g_string_append_c(str, '&');
+
+    p = amp + 1;
+  }
+}
+
+gchar *
+fb_capture_scrub_url(const gchar *url)
+{
+  GString *str = g_string_new(NULL);
+  const gchar *query;
+
+  g_return_val_if_fail(url != NULL, NULL);
+
+  if ((query = strchr(url, '?')))
+  {
+    g_string_append_len(str, url, query + 1 - url);
+    fb_capture_append_form(str, query + 1, strlen(query + 1));
+  }
+  else
+    g_string_append(str, url);
+
+  return g_string_free(str, FALSE);
+}
+
+gchar *
+fb_capture_scrub_form(gconstpointer form, gsize size, gsize *length)
+{
+  GString *str = g_string_sized_new(size);
+
+  if (form)
+    fb_capture_append_form(str, form, size);
+
+  if (length)
+    *length = str->len;
+
+  return g_string_free(str, FALSE);
+}
+
+/* blanks secret members whatever their value, session_cookies is an array */
+static void
+fb_capture_scrub_node(JsonNode *node)
+{
+  GList *members;
+  GList *l;
+  JsonObject *obj;
+  JsonArray *arr;
+
+  switch (JSON_NODE_TYPE(node))
+  {
+    case JSON_NODE_OBJECT:
+      obj = json_node_get_object(node);
+      members = json_object_get_members(obj);
+
+      for (l = members; l; l = l->next)
+      {
+        const gchar *name = l->data;
+
+        if (fb_capture_is_secret(name, strlen(name)))
+          json_object_set_string_member(obj, name, "");
+        else
+          fb_capture_scrub_node(json_object_get_member(obj, name));
+      }
+
+      g_list_free(members);
+      break;
+    case JSON_NODE_ARRAY:
+      arr = json_node_get_array(node);
+
+      for (guint i = 0; i < json_array_get_length(arr); i++)
+        fb_capture_scrub_node(json_array_get_element(arr, i));
+
+      break;
+    default:
+      break;
+  }
+}
+
+gchar *
+fb_capture_scrub_json(gconstpointer json, gsize size, gsize *length)
+{
+  const gchar *data = json;
+  JsonParser *parser;
+  JsonGenerator *gen;
+  GError *error = NULL;
+  gchar *scrubbed;
+  gsize len = 0;
+
+  if (!data || !size || (*data != '{' && *data != '['))
+    return NULL;
+
+  parser = json_parser_new();
+
+  if (json_parser_load_from_data(parser, data, size, &error))
+  {
+    fb_capture_scrub_node(json_parser_get_root(parser));
+    gen = json_generator_new();
+    json_generator_set_root(gen, json_parser_get_root(parser));
+    scrubbed = json_generator_to_data(gen, &len);
+    g_object_unref(gen);
+  }
+  else
+  {
+    /* can't tell where the secrets are, so keep none of it, but say so,
+     * an empty body is a puzzle when replaying */
+    g_message("Dropped a %" G_GSIZE_FORMAT " byte JSON body that doesn't "
+              "parse: %s", size, error->message);
+    g_error_free(error);
+    scrubbed = g_strdup("");
+  }
+
+  g_object_unref(parser);
+
+  if (length)
+    *length = len;
+
+  return scrubbed;
+}
+
+static GVariant *
+fb_capture_bytes(gconstpointer data, gsize size)
+{
+  return g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, data ? data : "",
+                                   data ? size : 0, 1);
+}
+
+static void
+fb_capture_write(FbCapture *capture, FbCaptureKind kind, GVariant *data)
+{
+  guint8 header[FB_CAPTURE_HEADER_SIZE];
+  guint64 time = GUINT64_TO_LE(g_get_monotonic_time() - capture->start);
+  guint32 size;
+
+  g_variant_ref_sink(data);
+
+  if (G_BYTE_ORDER == G_BIG_ENDIAN)
+  {
+    GVariant *swapped = g_variant_byteswap(data);
+
+    g_variant_unref(data);
+    data = swapped;
+  }
+
+  size = GUINT32_TO_LE(g_variant_get_size(data));
+  header[0] = kind;
+  memcpy(header + 1, &time, sizeof(time));
+  memcpy(header + 9, &size, sizeof(size));
+
+  fwrite(header, 1, sizeof(header), capture->file);
+  fwrite(g_variant_get_data(data), 1, g_variant_get_size(data),
+         capture->file);
+  /* a capture is most interesting when things crash */
+  fflush(capture->file);
+
+  g_variant_unref(data);
+}
+
+void
+fb_capture_http(const gchar *method, const gchar *url,
+                gconstpointer request, gsize request_size, guint status,
+                gconstpointer response, gsize response_size,
+                gint64 duration)
+{
+  FbCapture *capture = fb_capture_get();
+  gchar *scrubbed_url;
+  gchar *scrubbed_request;
+  gchar *scrubbed_response;
+  gsize scrubbed_size;
+  GVariant *data;
+
+  if (G_LIKELY(!capture))
+    return;
+
+  scrubbed_url = fb_capture_scrub_url(url);
+
+  /* FbHttp only ever POSTs forms */
+  scrubbed_request = fb_capture_scrub_form(request, request_size,
+                                           &request_size);
+
+  /* bodies that aren't JSON have no secrets */
+  if ((scrubbed_response = fb_capture_scrub_json(response, response_size,
+                                                 &scrubbed_size)))
+  {
+    response = scrubbed_response;
+    response_size = scrubbed_size;
+  }
+
+  data = g_variant_new("(ss@ayu@ayx)", method, scrubbed_url,
+                       fb_capture_bytes(scrubbed_request, request_size),
+                       status, fb_capture_bytes(response, response_size),
+                       duration);
+  fb_capture_write(capture, FB_CAPTURE_HTTP, data);
+
+  g_free(scrubbed_response);
+  g_free(scrubbed_request);
+  g_free(scrubbed_url);
+}
+
+void
+fb_capture_mqtt(gboolean incoming, gconstpointer data, gsize size)
+{
+  FbCapture *capture = fb_capture_get();
+  const guint8 *bytes = data;
+  guint8 *scrubbed = NULL;
+
+  if (G_LIKELY(!capture))
+    return;
+
+  /* CONNECT carries the access token, the rest of the stream is shaped
+   * by its size only */
+  if (!incoming && size > 1 && (bytes[0] >> 4) == FB_CAPTURE_MQTT_CONNECT)
+  {
+    gsize header = 1;
+
+    while (header < size && header < 5 && (bytes[header] & 0x80))
+      header++;
+
+    header++;
+    scrubbed = g_malloc0(size);
+    memcpy(scrubbed, bytes, MIN(header, size));
+    data = scrubbed;
+  }
+
+  fb_capture_write(capture,
+                   incoming ? FB_CAPTURE_MQTT_IN : FB_CAPTURE_MQTT_OUT,
+                   fb_capture_bytes(data, size));
+  g_free(scrubbed);
+}
+
+FbCaptureReader *
+fb_capture_reader_new(const gchar *filename, GError **error)
+{
+  FbCaptureReader *reader;
+  GMappedFile *file;
+  gsize magic = strlen(FB_CAPTURE_MAGIC);
+
+  if (!(file = g_mapped_file_new(filename, FALSE, error)))
+    return NULL;
+
+  if (g_mapped_file_get_length(file) < magic ||
+      memcmp(g_mapped_file_get_contents(file), FB_CAPTURE_MAGIC, magic))
+  {
+    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                "%s is not a capture", filename);
+    g_mapped_file_unref(file);
+    return NULL;
+  }
+
+  reader = g_new0(FbCaptureReader, 1);
+  reader->file = file;
+  reader->bytes = g_mapped_file_get_bytes(file);
+  reader->pos = magic;
+
+  return reader;
+}
+
+gboolean
+fb_capture_reader_next(FbCaptureReader *reader, FbCaptureRecord *record,
+                       GError **error)
+{
+  const guint8 *data;
+  gsize len;
+  guint64 time;
+  guint32 size;
+  GBytes *bytes;
+
+  g_return_val_if_fail(reader != NULL, FALSE);
+  g_return_val_if_fail(record != NULL, FALSE);
+
+  data = g_bytes_get_data(reader->bytes, &len);
+
+  if (reader->pos == len)
+    return FALSE;
+
+  if (len - reader->pos < FB_CAPTURE_HEADER_SIZE)
+    goto truncated;
+
+  data += reader->pos;
+  memcpy(&time, data + 1, sizeof(time));
+  memcpy(&size, data + 9, sizeof(size));
+  size = GUINT32_FROM_LE(size);
+
+  if (len - reader->pos - FB_CAPTURE_HEADER_SIZE < size)
+    goto truncated;
+
+  record->kind = data[0];
+  record->time = GUINT64_FROM_LE(time);
+
+  bytes = g_bytes_new_from_bytes(reader->bytes,
+                                 reader->pos + FB_CAPTURE_HEADER_SIZE, size);
+  record->data = g_variant_ref_sink(g_variant_new_from_bytes(
+    record->kind == FB_CAPTURE_HTTP ? G_VARIANT_TYPE(FB_CAPTURE_HTTP_TYPE) :
+                                      G_VARIANT_TYPE_BYTESTRING,
+    bytes, FALSE));
+  g_bytes_unref(bytes);
+
+  if (G_BYTE_ORDER == G_BIG_ENDIAN)
+  {
+    GVariant *swapped = g_variant_byteswap(record->data);
+
+    g_variant_unref(record->data);
+    record->data = swapped;
+  }
+
+  reader->pos += FB_CAPTURE_HEADER_SIZE + size;
+
+  return TRUE;
+
+truncated:
+  g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+              "Capture truncated at offset %" G_GSIZE_FORMAT, reader->pos);
+  reader->pos = len;
+
+  return FALSE;
+}
+
+void
+fb_capture_reader_free(FbCaptureReader *reader)
+{
+  if (!reader)
+    return;
+
+  g_bytes_unref(reader->bytes);
+  g_mapped_file_unref(reader->file);
+  g_free(reader);
+}
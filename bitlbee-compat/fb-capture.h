@@ -0,0 +1,177 @@
+/*
+ * This file is part of telepathy-facebook
+ *
+ * Copyright (C) 2025 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FB_CAPTURE_H__
+#define __FB_CAPTURE_H__
+
+/**
+ * @file fb-capture.h
+ * @brief Replayable capture of HTTP and MQTT traffic.
+ *
+ * With FACEBOOK_CAPTURE set to a file name, every completed HTTP request
+ * and every chunk read from or written to the MQTT socket is appended to
+ * that file, stamped with the time since capture started. Access tokens,
+ * passwords, signatures, the login email, the machine id and the MQTT
+ * CONNECT payload are blanked out before anything is written.
+ *
+ * The file starts with FB_CAPTURE_MAGIC, then holds records of a kind
+ * byte, a little endian 64 bit timestamp in microseconds, a little endian
+ * 32 bit size and that many bytes of serialized GVariant. HTTP records
+ * have the type FB_CAPTURE_HTTP_TYPE, MQTT records "ay".
+ *
+ * tools/fb-mock-server --replay serves a capture back to the connection
+ * manager.
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define FB_CAPTURE_MAGIC "FBCAPT01"
+
+/* method, url, request body, status, response body, duration in us */
+#define FB_CAPTURE_HTTP_TYPE "(ssayuayx)"
+
+typedef enum
+{
+  FB_CAPTURE_HTTP = 'h',
+  FB_CAPTURE_MQTT_IN = 'i',
+  FB_CAPTURE_MQTT_OUT = 'o'
+} FbCaptureKind;
+
+typedef struct _FbCaptureRecord FbCaptureRecord;
+
+struct _FbCaptureRecord
+{
+  FbCaptureKind kind;
+  /* microseconds since the capture started */
+  gint64 time;
+  /* of FB_CAPTURE_HTTP_TYPE or "ay", depending on kind */
+  GVariant *data;
+};
+
+typedef struct _FbCaptureReader FbCaptureReader;
+
+/**
+ * fb_capture_enabled:
+ *
+ * @returns: TRUE if traffic is being captured.
+ */
+gboolean
+fb_capture_enabled(void);
+
+/**
+ * fb_capture_http:
+ * @method: The request method.
+ * @url: The request URL.
+ * @request: (nullable): The request body.
+ * @request_size: The size of @request.
+ * @status: The response status.
+ * @response: (nullable): The decoded response body.
+ * @response_size: The size of @response.
+ * @duration: Microseconds the request took.
+ *
+ * Appends a scrubbed HTTP record to the capture, if enabled.
+ */
+void
+fb_capture_http(const gchar *method, const gchar *url,
+                gconstpointer request, gsize request_size, guint status,
+                gconstpointer response, gsize response_size,
+                gint64 duration);
+
+/**
+ * fb_capture_mqtt:
+ * @incoming: TRUE if the data was read from the socket.
+ * @data: The data.
+ * @size: The size of @data.
+ *
+ * Appends an MQTT record to the capture, if enabled.
+ */
+void
+fb_capture_mqtt(gboolean incoming, gconstpointer data, gsize size);
+
+/**
+ * fb_capture_scrub_url:
+ * @url: The URL.
+ *
+ * @returns: (transfer full): @url with the values of secret query
+ *   parameters left empty.
+ */
+gchar *
+fb_capture_scrub_url(const gchar *url);
+
+/**
+ * fb_capture_scrub_form:
+ * @form: (nullable): The form encoded data.
+ * @size: The size of @form.
+ * @length: (out) (optional): return location for the size of the result.
+ *
+ * @returns: (transfer full): @form with the values of secret fields left
+ *   empty.
+ */
+gchar *
+fb_capture_scrub_form(gconstpointer form, gsize size, gsize *length);
+
+/**
+ * fb_capture_scrub_json:
+ * @json: (nullable): The response body.
+ * @size: The size of @json.
+ * @length: (out) (optional): return location for the size of the result.
+ *
+ * Blanks secret members of any type, nested ones included. A body that
+ * looks like JSON but doesn't parse is dropped as a whole, and a message
+ * is logged about it.
+ *
+ * @returns: (transfer full) (nullable): the scrubbed body, or NULL if
+ *   @json is not JSON.
+ */
+gchar *
+fb_capture_scrub_json(gconstpointer json, gsize size, gsize *length);
+
+/**
+ * fb_capture_reader_new:
+ * @filename: The capture file.
+ * @error: return location for a #GError, or NULL.
+ *
+ * @returns: (transfer full): a reader, or NULL on error.
+ */
+FbCaptureReader *
+fb_capture_reader_new(const gchar *filename, GError **error);
+
+/**
+ * fb_capture_reader_next:
+ * @reader: The #FbCaptureReader.
+ * @record: (out caller-allocates): The record, its data has to be unreffed.
+ * @error: return location for a #GError, or NULL.
+ *
+ * @returns: FALSE at the end of the capture, or if it is truncated.
+ */
+gboolean
+fb_capture_reader_next(FbCaptureReader *reader, FbCaptureRecord *record,
+                       GError **error);
+
+/**
+ * fb_capture_reader_free:
+ * @reader: The #FbCaptureReader.
+ */
+void
+fb_capture_reader_free(FbCaptureReader *reader);
+
+G_END_DECLS
+
+#endif /* __FB_CAPTURE_H__ */
@@ -0,0 +1,276 @@
+/*
+ * This file is part of telepathy-facebook
+ *
+ * Copyright (C) 2025 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef __FB_HTTP_EXT_H__
+#define __FB_HTTP_EXT_H__
+
+/**
+ * @file fb-http-ext.h
+ * @brief FbHttp additions the bitlbee-facebook API doesn't have.
+ *
+ * facebook-http.h comes with bitlbee-facebook, anything our libsoup based
+ * implementation offers on top of it is declared here.
+ */
+
+#include "facebook-http.h"
+
+G_BEGIN_DECLS
+
+/**
+ * fb_http_push_cancellable:
+ * @cancellable: (nullable): The #GCancellable.
+ *
+ * Makes @cancellable the default of requests created until the matching
+ * fb_http_pop_cancellable(), including the ones FbApi creates on its own.
+ * Request callbacks run with the cancellable of their request pushed, so
+ * follow-up requests inherit it.
+ */
+void
+fb_http_push_cancellable(GCancellable *cancellable);
+
+/**
+ * fb_http_pop_cancellable:
+ *
+ * Restores the default cancellable fb_http_push_cancellable() replaced.
+ */
+void
+fb_http_pop_cancellable(void);
+
+/**
+ * fb_http_request_set_cancellable:
+ * @req: The #FbHttpRequest.
+ * @cancellable: (nullable): The #GCancellable.
+ *
+ * Cancelling @cancellable completes @req right away with a
+ * G_IO_ERROR_CANCELLED error. Must be called before fb_http_request_send().
+ */
+void
+fb_http_request_set_cancellable(FbHttpRequest *req,
+                                GCancellable *cancellable);
+
+/**
+ * fb_http_request_set_timeout:
+ * @req: The #FbHttpRequest.
+ * @seconds: The timeout, or 0 for none.
+ *
+ * Fails @req with G_IO_ERROR_TIMED_OUT if it hasn't completed @seconds
+ * after fb_http_request_send(). Must be called before sending.
+ */
+void
+fb_http_request_set_timeout(FbHttpRequest *req, guint seconds);
+
+/**
+ * FbHttpPriority:
+ * @FB_HTTP_PRIORITY_CRITICAL: Login and anything else the connection can't
+ *   do without.
+ * @FB_HTTP_PRIORITY_INTERACTIVE: Somebody is waiting for it, the default.
+ * @FB_HTTP_PRIORITY_BACKGROUND: Bulk downloads nobody is waiting for.
+ *
+ * Requests of a higher class always go first, and every class is limited
+ * in how many of its requests can be in flight, so a backlog of
+ * background requests never holds up the others.
+ */
+typedef enum
+{
+  FB_HTTP_PRIORITY_CRITICAL,
+  FB_HTTP_PRIORITY_INTERACTIVE,
+  FB_HTTP_PRIORITY_BACKGROUND,
+
+  FB_HTTP_PRIORITY_N
+} FbHttpPriority;
+
+/**
+ * fb_http_request_set_priority:
+ * @req: The #FbHttpRequest.
+ * @priority: The #FbHttpPriority.
+ *
+ * Must be called before fb_http_request_send().
+ */
+void
+fb_http_request_set_priority(FbHttpRequest *req, FbHttpPriority priority);
+
+/**
+ * fb_http_add_critical_url:
+ * @url: The URL.
+ *
+ * Puts requests to @url in #FB_HTTP_PRIORITY_CRITICAL by default, for the
+ * FbApi endpoints the connection can't do without, which don't set a
+ * priority themselves.
+ */
+void
+fb_http_add_critical_url(const gchar *url);
+
+/**
+ * fb_http_get_backlog:
+ * @priority: The #FbHttpPriority.
+ *
+ * Counts the requests of @priority and the classes above it, across all
+ * FbHttp instances, so background work can tell it would be in the way.
+ *
+ * @returns: the number of those requests queued or in flight.
+ */
+guint
+fb_http_get_backlog(FbHttpPriority priority);
+
+/**
+ * fb_http_request_set_validators:
+ * @req: The #FbHttpRequest.
+ * @etag: (nullable): ETag of the cached copy.
+ * @last_modified: (nullable): Last-Modified date of the cached copy.
+ *
+ * Makes @req conditional, a 304 response is then not treated as an error,
+ * see fb_http_request_not_modified().
+ */
+void
+fb_http_request_set_validators(FbHttpRequest *req, const gchar *etag,
+                               const gchar *last_modified);
+
+/**
+ * fb_http_request_not_modified:
+ * @req: The #FbHttpRequest.
+ *
+ * @returns: TRUE if a conditional request found the cached copy current.
+ */
+gboolean
+fb_http_request_not_modified(FbHttpRequest *req);
+
+/**
+ * fb_http_request_get_sizes:
+ * @req: The #FbHttpRequest.
+ * @wire_size: (out) (optional): return location for the size of the body
+ *   as it came over the wire.
+ * @body_size: (out) (optional): return location for the size of the
+ *   decoded body.
+ *
+ * Bodies are requested compressed, the difference is what that saved.
+ */
+void
+fb_http_request_get_sizes(FbHttpRequest *req, gsize *wire_size,
+                          gsize *body_size);
+
+/**
+ * fb_http_request_take_bytes:
+ * @req: The #FbHttpRequest.
+ *
+ * Takes the response body over from @req without copying it, after that
+ * fb_http_request_get_data() returns nothing. Only valid from within the
+ * request callback.
+ *
+ * @returns: (transfer full) (nullable): the body, NULL if it was taken
+ *   already.
+ */
+GBytes *
+fb_http_request_take_bytes(FbHttpRequest *req);
+
+/**
+ * fb_http_request_get_etag:
+ * @req: The #FbHttpRequest.
+ *
+ * Only valid from within the request callback.
+ *
+ * @returns: (nullable): the ETag response header.
+ */
+const gchar *
+fb_http_request_get_etag(FbHttpRequest *req);
+
+/**
+ * fb_http_request_get_last_modified:
+ * @req: The #FbHttpRequest.
+ *
+ * Only valid from within the request callback.
+ *
+ * @returns: (nullable): the Last-Modified response header.
+ */
+const gchar *
+fb_http_request_get_last_modified(FbHttpRequest *req);
+
+/**
+ * FbHttpChunkFunc:
+ * @req: The #FbHttpRequest.
+ * @data: The chunk.
+ * @size: The size of @data.
+ * @user_data: The user-defined data.
+ *
+ * The type of callback streaming requests hand body chunks to.
+ */
+typedef void (*FbHttpChunkFunc) (FbHttpRequest *req, const gchar *data,
+                                 gsize size, gpointer user_data);
+
+/**
+ * fb_http_request_set_chunk_func:
+ * @req: The #FbHttpRequest.
+ * @func: The #FbHttpChunkFunc.
+ * @user_data: The user-defined data.
+ *
+ * Makes @req stream its response body, @func gets every chunk as it arrives
+ * and the body is not kept, so fb_http_request_get_data() returns nothing.
+ * Error responses are still buffered as usual. Must be called before
+ * fb_http_request_send().
+ */
+void
+fb_http_request_set_chunk_func(FbHttpRequest *req, FbHttpChunkFunc func,
+                               gpointer user_data);
+
+/**
+ * fb_http_values_encode:
+ * @values: The #FbHttpValues.
+ * @str: The #GString to append to.
+ *
+ * Appends @values form encoded to @str, sorted by name so the same values
+ * always encode the same.
+ */
+void
+fb_http_values_encode(FbHttpValues *values, GString *str);
+
+/**
+ * fb_http_request_set_idempotent:
+ * @req: The #FbHttpRequest.
+ * @idempotent: TRUE if @req may be sent more than once.
+ *
+ * Idempotent requests are retried on transient failures: connection
+ * errors, 408, 429 and 5xx gateway responses. Others are only retried if
+ * the server never saw them or explicitly refused them (429, 503). GET
+ * requests are idempotent by default. Must be called before
+ * fb_http_request_send().
+ */
+void
+fb_http_request_set_idempotent(FbHttpRequest *req, gboolean idempotent);
+
+/**
+ * fb_http_add_idempotent_url:
+ * @url: The URL.
+ *
+ * Makes requests to @url idempotent by default, whatever their method.
+ * Meant for FbApi endpoints that POST queries without side effects.
+ */
+void
+fb_http_add_idempotent_url(const gchar *url);
+
+/**
+ * fb_http_error_is_transient:
+ * @error: (nullable): A #GError from a request.
+ *
+ * @returns: TRUE if @error is one that happens in the normal course of
+ *   things: a timeout, a cancellation, a connection error or a busy
+ *   server.
+ */
+gboolean
+fb_http_error_is_transient(const GError *error);
+
+G_END_DECLS
+
+#endif /* __FB_HTTP_EXT_H__ */
@@ -0,0 +1,234 @@
+/*
+ * This file is part of telepathy-facebook
+ *
+ * Copyright (C) 2025 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <libsoup/soup.h>
+
+#include "fb-http-stats.h"
+
+/* CDN URLs are unique per file, everything over the limit goes to one
+ * catch-all endpoint */
+#define FB_HTTP_STATS_MAX_ENDPOINTS 64
+#define FB_HTTP_STATS_OTHER "other"
+/* path segments an endpoint is told apart by */
+#define FB_HTTP_STATS_PATH_DEPTH 2
+
+static const guint bounds[FB_HTTP_STATS_BUCKETS - 1] =
+{
+  5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+static const gchar *phase_names[FB_HTTP_PHASE_N] =
+{
+  "queue", "dns", "connect", "tls", "wait", "total"
+};
+
+struct _FbHttpHistogram
+{
+  guint count;
+  guint64 sum;
+  guint buckets[FB_HTTP_STATS_BUCKETS];
+};
+
+typedef struct _FbHttpHistogram FbHttpHistogram;
+
+struct _FbHttpEndpointStats
+{
+  FbHttpHistogram phases[FB_HTTP_PHASE_N];
+};
+
+typedef struct _FbHttpEndpointStats FbHttpEndpointStats;
+
+static GHashTable *
+fb_http_stats_get_table(void)
+{
+  static GHashTable *endpoints = NULL;
+
+  if (G_UNLIKELY(!endpoints))
+    endpoints = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+  return endpoints;
+}
+
+/* host plus the first couple of path segments */
+static gchar *
+fb_http_stats_endpoint(const gchar *url)
+{
+  SoupURI *uri = soup_uri_new(url);
+  GString *endpoint;
+  const gchar *p;
+  guint depth = 0;
+
+  if (!uri)
+    return g_strdup(FB_HTTP_STATS_OTHER);
+
+  endpoint = g_string_new(uri->host);
+
+  for (p = uri->path; *p && depth <= FB_HTTP_STATS_PATH_DEPTH; p++)
+  {
+    if (*p == '/' && ++depth > FB_HTTP_STATS_PATH_DEPTH)
+    {
+      g_string_append(endpoint, "/*");
+      break;
+    }
+
+    g_string_append_c(endpoint, *p);
+  }
+
+  soup_uri_free(uri);
+
+  return g_string_free(endpoint, FALSE);
+}
+
+static void
+fb_http_histogram_add(FbHttpHistogram *hist, gint64 usecs)
+{
+  guint ms = usecs / 1000;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(bounds) && ms > bounds[i]; i++);
+
+  hist->count++;
+  hist->sum += usecs;
+  hist->buckets[i]++;
+}
+
+void
+fb_http_stats_add(const gchar *url, const gint64 durations[FB_HTTP_PHASE_N])
+{
+  GHashTable *endpoints = fb_http_stats_get_table();
+  gchar *endpoint = fb_http_stats_endpoint(url);
+  FbHttpEndpointStats *stats = g_hash_table_lookup(endpoints, endpoint);
+
+  if (!stats)
+  {
+    if (g_hash_table_size(endpoints) >= FB_HTTP_STATS_MAX_ENDPOINTS)
+    {
+      g_free(endpoint);
+      endpoint = g_strdup(FB_HTTP_STATS_OTHER);
+      stats = g_hash_table_lookup(endpoints, endpoint);
+    }
+
+    if (!stats)
+    {
+      stats = g_new0(FbHttpEndpointStats, 1);
+      g_hash_table_insert(endpoints, endpoint, stats);
+      endpoint = NULL;
+    }
+  }
+
+  g_free(endpoint);
+
+  for (guint i = 0; i < FB_HTTP_PHASE_N; i++)
+  {
+    if (durations[i] >= 0)
+      fb_http_histogram_add(&stats->phases[i], durations[i]);
+  }
+}
+
+GVariant *
+fb_http_stats_dup(void)
+{
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+
+  g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sa{s(utau)}}"));
+  g_hash_table_iter_init(&iter, fb_http_stats_get_table());
+
+  while (g_hash_table_iter_next(&iter, &key, &value))
+  {
+    FbHttpEndpointStats *stats = value;
+
+    g_variant_builder_open(&builder, G_VARIANT_TYPE("{sa{s(utau)}}"));
+    g_variant_builder_add(&builder, "s", key);
+    g_variant_builder_open(&builder, G_VARIANT_TYPE("a{s(utau)}"));
+
+    for (guint i = 0; i < FB_HTTP_PHASE_N; i++)
+    {
+      FbHttpHistogram *hist = &stats->phases[i];
+
+      if (!hist->count)
+        continue;
+
+      g_variant_builder_add(
+        &builder, "{s(ut@au)}", phase_names[i], hist->count, hist->sum,
+        g_variant_new_fixed_array(G_VARIANT_TYPE_UINT32, hist->buckets,
+                                  FB_HTTP_STATS_BUCKETS, sizeof(guint)));
+    }
+
+    g_variant_builder_close(&builder);
+    g_variant_builder_close(&builder);
+  }
+
+  return g_variant_ref_sink(g_variant_builder_end(&builder));
+}
+
+const guint *
+fb_http_stats_get_bounds(guint *n_bounds)
+{
+  *n_bounds = G_N_ELEMENTS(bounds);
+
+  return bounds;
+}
+
+gchar *
+fb_http_stats_format(void)
+{
+  GString *str = g_string_new(NULL);
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+
+  g_hash_table_iter_init(&iter, fb_http_stats_get_table());
+
+  while (g_hash_table_iter_next(&iter, &key, &value))
+  {
+    FbHttpEndpointStats *stats = value;
+
+    g_string_append_printf(str, "%s:\n", (const gchar *)key);
+
+    for (guint i = 0; i < FB_HTTP_PHASE_N; i++)
+    {
+      FbHttpHistogram *hist = &stats->phases[i];
+
+      if (!hist->count)
+        continue;
+
+      g_string_append_printf(str, "  %-8s %u, avg %" G_GUINT64_FORMAT " ms,",
+                             phase_names[i], hist->count,
+                             hist->sum / hist->count / 1000);
+
+      for (guint j = 0; j < FB_HTTP_STATS_BUCKETS; j++)
+      {
+        if (j < G_N_ELEMENTS(bounds))
+          g_string_append_printf(str, " <=%u:%u", bounds[j], hist->buckets[j]);
+        else
+          g_string_append_printf(str, " >:%u", hist->buckets[j]);
+      }
+
+      g_string_append_c(str, '\n');
+    }
+  }
+
+  return g_string_free(str, FALSE);
+}
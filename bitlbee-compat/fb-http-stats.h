@@ -0,0 +1,102 @@
+/*
+ * This file is part of telepathy-facebook
+ *
+ * Copyright (C) 2025 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef __FB_HTTP_STATS_H__
+#define __FB_HTTP_STATS_H__
+
+/**
+ * @file fb-http-stats.h
+ * @brief Per-endpoint HTTP latency histograms.
+ *
+ * Every request FbHttp completes is split into phases, and the time each
+ * phase took goes into a histogram of its endpoint. As the session is
+ * shared, so are the statistics: they cover every account in the process.
+ * That is why they are read through the functions below rather than from
+ * any one connection; the connection manager logs them when a connection
+ * shuts down.
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * FbHttpPhase:
+ * @FB_HTTP_PHASE_QUEUE: Waiting for a connection.
+ * @FB_HTTP_PHASE_DNS: Resolving the host name.
+ * @FB_HTTP_PHASE_CONNECT: Establishing the TCP connection.
+ * @FB_HTTP_PHASE_TLS: The TLS handshake.
+ * @FB_HTTP_PHASE_WAIT: Sending the request up to the first response byte.
+ * @FB_HTTP_PHASE_TOTAL: From fb_http_request_send() to the callback.
+ *
+ * Phases a reused connection skips are not counted.
+ */
+typedef enum
+{
+  FB_HTTP_PHASE_QUEUE,
+  FB_HTTP_PHASE_DNS,
+  FB_HTTP_PHASE_CONNECT,
+  FB_HTTP_PHASE_TLS,
+  FB_HTTP_PHASE_WAIT,
+  FB_HTTP_PHASE_TOTAL,
+
+  FB_HTTP_PHASE_N
+} FbHttpPhase;
+
+/* the last bucket counts everything above the last bound */
+#define FB_HTTP_STATS_BUCKETS 12
+
+/**
+ * fb_http_stats_add:
+ * @url: The request URL.
+ * @durations: Time each phase took in microseconds, negative if it didn't
+ *   happen.
+ */
+void
+fb_http_stats_add(const gchar *url, const gint64 durations[FB_HTTP_PHASE_N]);
+
+/**
+ * fb_http_stats_dup:
+ *
+ * Endpoint -> phase name -> (count, total microseconds, bucket counts),
+ * for the whole process.
+ *
+ * @returns: (transfer full): the statistics as an a{sa{s(utau)}}.
+ */
+GVariant *
+fb_http_stats_dup(void);
+
+/**
+ * fb_http_stats_get_bounds:
+ * @n_bounds: (out): return location for the number of bounds.
+ *
+ * @returns: (transfer none): upper bounds of the buckets, in milliseconds.
+ */
+const guint *
+fb_http_stats_get_bounds(guint *n_bounds);
+
+/**
+ * fb_http_stats_format:
+ *
+ * @returns: (transfer full): the statistics as text, for the debug log.
+ */
+gchar *
+fb_http_stats_format(void);
+
+G_END_DECLS
+
+#endif /* __FB_HTTP_STATS_H__ */
@@ -0,0 +1,258 @@
+/*
+ * This file is part of telepathy-facebook
+ *
+ * Copyright (C) 2025 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+
+#include "fb-capture.h"
+#include "fb-http-trace.h"
+#include "facebook-util.h"
+
+/* requests kept when only BITLBEE_DEBUG asked for tracing */
+#define FB_HTTP_TRACE_DEFAULT_DEPTH 32
+#define FB_HTTP_TRACE_DEBUG_BODY 4096
+
+struct _FbHttpTrace
+{
+  FbHttpTraceRecord **ring;
+  guint depth;
+  /* next slot to write */
+  guint head;
+  gsize body_max;
+  /* log every record as it completes */
+  gboolean verbose;
+  guint64 next_id;
+};
+
+typedef struct _FbHttpTrace FbHttpTrace;
+
+static FbHttpTrace *
+fb_http_trace_get(void)
+{
+  static FbHttpTrace trace;
+  static gboolean inited = FALSE;
+  const gchar *env;
+
+  if (G_LIKELY(inited))
+    return trace.depth ? &trace : NULL;
+
+  inited = TRUE;
+  trace.verbose = g_getenv("BITLBEE_DEBUG") ||
+      g_getenv("BITLBEE_DEBUG_FACEBOOK");
+
+  if (trace.verbose)
+  {
+    trace.depth = FB_HTTP_TRACE_DEFAULT_DEPTH;
+    trace.body_max = FB_HTTP_TRACE_DEBUG_BODY;
+  }
+
+  if ((env = g_getenv("FACEBOOK_HTTP_TRACE")))
+    trace.depth = strtoul(env, NULL, 10);
+
+  if ((env = g_getenv("FACEBOOK_HTTP_TRACE_BODY")))
+    trace.body_max = strtoul(env, NULL, 10);
+
+  if (!trace.depth)
+    return NULL;
+
+  trace.ring = g_new0(FbHttpTraceRecord *, trace.depth);
+
+  return &trace;
+}
+
+gboolean
+fb_http_trace_enabled(void)
+{
+  return fb_http_trace_get() != NULL;
+}
+
+static GBytes *
+fb_http_trace_capture(FbHttpTrace *trace, gconstpointer body, gsize size)
+{
+  if (!body || !size || !trace->body_max)
+    return NULL;
+
+  return g_bytes_new(body, MIN(size, trace->body_max));
+}
+
+FbHttpTraceRecord *
+fb_http_trace_begin(const gchar *method, const gchar *url,
+                    gconstpointer body, gsize size)
+{
+  FbHttpTrace *trace = fb_http_trace_get();
+  FbHttpTraceRecord *record;
+
+  if (G_LIKELY(!trace))
+    return NULL;
+
+  record = g_slice_new0(FbHttpTraceRecord);
+  record->id = trace->next_id++;
+  record->method = g_strdup(method);
+  /* the ring ends up in debug logs, which end up in bug reports */
+  record->url = fb_capture_scrub_url(url);
+  record->request_size = size;
+
+  if (body && size && trace->body_max)
+  {
+    gsize len;
+    gchar *scrubbed = fb_capture_scrub_form(body, size, &len);
+
+    record->request_body = fb_http_trace_capture(trace, scrubbed, len);
+    g_free(scrubbed);
+  }
+
+  record->started = g_get_monotonic_time();
+
+  return record;
+}
+
+void
+fb_http_trace_record_free(FbHttpTraceRecord *record)
+{
+  if (!record)
+    return;
+
+  g_free(record->method);
+  g_free(record->url);
+
+  if (record->request_body)
+    g_bytes_unref(record->request_body);
+
+  if (record->response_body)
+    g_bytes_unref(record->response_body);
+
+  g_slice_free(FbHttpTraceRecord, record);
+}
+
+void
+fb_http_trace_end(FbHttpTraceRecord *record, guint status, gsize wire_size,
+                  gconstpointer body, gsize size)
+{
+  FbHttpTrace *trace = fb_http_trace_get();
+  gchar *scrubbed = NULL;
+  gsize len;
+
+  g_return_if_fail(record != NULL);
+  g_return_if_fail(trace != NULL);
+
+  record->finished = g_get_monotonic_time();
+  record->status = status;
+  record->wire_size = wire_size;
+  record->body_size = size;
+
+  if (trace->body_max &&
+      (scrubbed = fb_capture_scrub_json(body, size, &len)))
+  {
+    body = scrubbed;
+    size = len;
+  }
+
+  record->response_body = fb_http_trace_capture(trace, body, size);
+  g_free(scrubbed);
+
+  fb_http_trace_record_free(trace->ring[trace->head]);
+  trace->ring[trace->head] = record;
+  trace->head = (trace->head + 1) % trace->depth;
+
+  if (trace->verbose)
+  {
+    gchar *text = fb_http_trace_record_format(record);
+
+    fb_util_debug_info("%s", text);
+    g_free(text);
+  }
+}
+
+static void
+fb_http_trace_format_body(GString *str, const gchar *prefix, GBytes *body,
+                          gsize size)
+{
+  gsize len;
+  const gchar *data;
+
+  if (!body)
+    return;
+
+  data = g_bytes_get_data(body, &len);
+  g_string_append_printf(str, "\n  %s: %.*s", prefix, (gint)len, data);
+
+  /* scrubbing changes the size too, only cutting is worth a note */
+  if (len < size && len == fb_http_trace_get()->body_max)
+    g_string_append_printf(str, "... (%" G_GSIZE_FORMAT " more bytes)",
+                           size - len);
+}
+
+gchar *
+fb_http_trace_record_format(const FbHttpTraceRecord *record)
+{
+  GString *str;
+
+  g_return_val_if_fail(record != NULL, NULL);
+
+  str = g_string_new(NULL);
+  g_string_append_printf(
+    str, "#%" G_GUINT64_FORMAT " %s %s -> %u, %" G_GSIZE_FORMAT
+    " bytes sent, %" G_GSIZE_FORMAT " bytes received (%" G_GSIZE_FORMAT
+    " decoded), %" G_GINT64_FORMAT " ms",
+    record->id, record->method, record->url, record->status,
+    record->request_size, record->wire_size, record->body_size,
+    (record->finished - record->started) / 1000);
+
+  fb_http_trace_format_body(str, "request", record->request_body,
+                            record->request_size);
+  fb_http_trace_format_body(str, "response", record->response_body,
+                            record->body_size);
+
+  return g_string_free(str, FALSE);
+}
+
+void
+fb_http_trace_foreach(FbHttpTraceFunc func, gpointer data)
+{
+  FbHttpTrace *trace = fb_http_trace_get();
+
+  if (!trace)
+    return;
+
+  for (guint i = 0; i < trace->depth; i++)
+  {
+    FbHttpTraceRecord *record =
+      trace->ring[(trace->head + i) % trace->depth];
+
+    if (record)
+      func(record, data);
+  }
+}
+
+static void
+fb_http_trace_dump_cb(const FbHttpTraceRecord *record, gpointer data)
+{
+  gchar *text = fb_http_trace_record_format(record);
+
+  fb_util_debug_info("%s", text);
+  g_free(text);
+}
+
+void
+fb_http_trace_dump(void)
+{
+  fb_http_trace_foreach(fb_http_trace_dump_cb, NULL);
+}
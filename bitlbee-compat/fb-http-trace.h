@@ -0,0 +1,145 @@
+/*
+ * This file is part of telepathy-facebook
+ *
+ * Copyright (C) 2025 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef __FB_HTTP_TRACE_H__
+#define __FB_HTTP_TRACE_H__
+
+/**
+ * @file fb-http-trace.h
+ * @brief HTTP trace ring buffer.
+ *
+ * Keeps the last requests FbHttp made as raw records, text is only
+ * produced when somebody asks for it. Tracing is off unless one of these
+ * is set in the environment:
+ *
+ *  - FACEBOOK_HTTP_TRACE: number of requests to keep.
+ *  - FACEBOOK_HTTP_TRACE_BODY: bytes of each body to keep, 0 by default.
+ *  - BITLBEE_DEBUG or BITLBEE_DEBUG_FACEBOOK: keeps a default number of
+ *    requests and logs every one as it completes.
+ *
+ * URLs and bodies are scrubbed of tokens and passwords like captures are,
+ * see fb-capture.h.
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _FbHttpTraceRecord FbHttpTraceRecord;
+
+struct _FbHttpTraceRecord
+{
+  guint64 id;
+  gchar *method;
+  gchar *url;
+  guint status;
+  gsize request_size;
+  /* response body size on the wire and after decoding */
+  gsize wire_size;
+  gsize body_size;
+  /* monotonic times, in microseconds */
+  gint64 started;
+  gint64 finished;
+  /* bodies, cut to the configured size */
+  GBytes *request_body;
+  GBytes *response_body;
+};
+
+/**
+ * FbHttpTraceFunc:
+ * @record: (transfer none): The record.
+ * @data: The user-defined data.
+ */
+typedef void (*FbHttpTraceFunc) (const FbHttpTraceRecord *record,
+                                 gpointer data);
+
+/**
+ * fb_http_trace_enabled:
+ *
+ * @returns: TRUE if requests are traced.
+ */
+gboolean
+fb_http_trace_enabled(void);
+
+/**
+ * fb_http_trace_begin:
+ * @method: The request method.
+ * @url: The request URL.
+ * @body: (nullable): The request body.
+ * @size: The size of @body.
+ *
+ * @returns: (transfer full): a record to pass to fb_http_trace_end(), or
+ *   NULL if tracing is disabled.
+ */
+FbHttpTraceRecord *
+fb_http_trace_begin(const gchar *method, const gchar *url,
+                    gconstpointer body, gsize size);
+
+/**
+ * fb_http_trace_end:
+ * @record: (transfer full): The record from fb_http_trace_begin().
+ * @status: The response status.
+ * @wire_size: The response body size on the wire.
+ * @body: (nullable): The decoded response body.
+ * @size: The size of @body.
+ *
+ * Completes @record and adds it to the ring, dropping the oldest one if
+ * it is full.
+ */
+void
+fb_http_trace_end(FbHttpTraceRecord *record, guint status, gsize wire_size,
+                  gconstpointer body, gsize size);
+
+/**
+ * fb_http_trace_record_free:
+ * @record: The record.
+ *
+ * Only needed for records that never made it to fb_http_trace_end().
+ */
+void
+fb_http_trace_record_free(FbHttpTraceRecord *record);
+
+/**
+ * fb_http_trace_record_format:
+ * @record: The record.
+ *
+ * @returns: (transfer full): @record as text.
+ */
+gchar *
+fb_http_trace_record_format(const FbHttpTraceRecord *record);
+
+/**
+ * fb_http_trace_foreach:
+ * @func: The #FbHttpTraceFunc.
+ * @data: The user-defined data.
+ *
+ * Calls @func for every record in the ring, oldest first.
+ */
+void
+fb_http_trace_foreach(FbHttpTraceFunc func, gpointer data);
+
+/**
+ * fb_http_trace_dump:
+ *
+ * Writes every record in the ring to the debug log.
+ */
+void
+fb_http_trace_dump(void);
+
+G_END_DECLS
+
+#endif /* __FB_HTTP_TRACE_H__ */
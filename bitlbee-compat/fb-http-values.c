@@ -20,21 +20,41 @@
 #include "config.h"
 #endif
 
+#include <stdlib.h>
 #include <libsoup/soup.h>
 
-#include "facebook-http.h"
+#include "fb-http-ext.h"
 #include "bitlbee.h"
 
+/* names compare case-insensitively, so they have to hash that way too */
+static guint
+fb_http_value_hash(gconstpointer v)
+{
+  const gchar *p;
+  guint32 h = 5381;
+
+  for (p = v; *p; p++)
+    h = (h << 5) + h + g_ascii_tolower(*p);
+
+  return h;
+}
+
 static gboolean
 fb_http_value_equal(gconstpointer a, gconstpointer b)
 {
     return g_ascii_strcasecmp(a, b) == 0;
 }
 
+static gint
+fb_http_value_cmp(gconstpointer a, gconstpointer b)
+{
+  return g_ascii_strcasecmp(*(const gchar **)a, *(const gchar **)b);
+}
+
 FbHttpValues *
 fb_http_values_new(void)
 {
-        return g_hash_table_new_full(g_str_hash, fb_http_value_equal,
+        return g_hash_table_new_full(fb_http_value_hash, fb_http_value_equal,
                                      g_free, g_free);
 }
 
@@ -101,10 +121,59 @@ fb_http_values_remove(FbHttpValues *values, const gchar *name)
     return g_hash_table_remove(values, name);
 }
 
+/* sorted, signing wants them that way and sorting a sorted list is cheap */
 GList *
 fb_http_values_get_keys(FbHttpValues *values)
 {
-    return g_hash_table_get_keys(values);
+    return g_list_sort(g_hash_table_get_keys(values),
+                       (GCompareFunc)g_ascii_strcasecmp);
+}
+
+static void
+fb_http_values_append_encoded(GString *str, const gchar *in)
+{
+  static const gchar hex[] = "0123456789ABCDEF";
+  const guchar *p;
+
+  for (p = (const guchar *)in; *p; p++)
+  {
+    if (g_ascii_isalnum(*p) || *p == '-' || *p == '_' || *p == '.')
+      g_string_append_c(str, *p);
+    else if (*p == ' ')
+      g_string_append_c(str, '+');
+    else
+    {
+      g_string_append_c(str, '%');
+      g_string_append_c(str, hex[*p >> 4]);
+      g_string_append_c(str, hex[*p & 0xf]);
+    }
+  }
+}
+
+void
+fb_http_values_encode(FbHttpValues *values, GString *str)
+{
+  gpointer *keys;
+  guint len;
+  guint i;
+
+  g_return_if_fail(values != NULL);
+  g_return_if_fail(str != NULL);
+
+  keys = g_hash_table_get_keys_as_array(values, &len);
+  qsort(keys, len, sizeof(*keys), fb_http_value_cmp);
+
+  for (i = 0; i < len; i++)
+  {
+    if (i)
+      g_string_append_c(str, '&');
+
+    fb_http_values_append_encoded(str, keys[i]);
+    g_string_append_c(str, '=');
+    fb_http_values_append_encoded(str, g_hash_table_lookup(values, keys[i]));
+  }
+
+  g_free(keys);
 }
 
 static const gchar *
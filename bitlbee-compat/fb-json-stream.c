@@ -0,0 +1,281 @@
+/*
+ * This file is part of telepathy-facebook
+ *
+ * Copyright (C) 2025 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "fb-json-stream.h"
+
+struct _FbJsonStream
+{
+  FbJsonStreamFunc func;
+  gpointer data;
+  JsonParser *parser;
+  gboolean split_array;
+  /* the top level array got opened/closed */
+  gboolean opened;
+  gboolean closed;
+  /* bytes of the value in progress carried over from earlier chunks */
+  GString *value;
+  gboolean in_value;
+  gboolean in_string;
+  gboolean escaped;
+  gboolean scalar;
+  guint depth;
+  GError *error;
+};
+
+FbJsonStream *
+fb_json_stream_new(gboolean split_array, FbJsonStreamFunc func,
+                   gpointer data)
+{
+  FbJsonStream *stream = g_slice_new0(FbJsonStream);
+
+  stream->func = func;
+  stream->data = data;
+  stream->parser = json_parser_new();
+  stream->split_array = split_array;
+  stream->value = g_string_new(NULL);
+
+  return stream;
+}
+
+static gboolean
+fb_json_stream_emit(FbJsonStream *stream, const gchar *data, gsize size)
+{
+  const gchar *value = data;
+
+  /* values that fit in one chunk are parsed in place */
+  if (stream->value->len)
+  {
+    g_string_append_len(stream->value, data, size);
+    value = stream->value->str;
+    size = stream->value->len;
+  }
+
+  stream->in_value = FALSE;
+
+  if (!json_parser_load_from_data(stream->parser, value, size,
+                                  &stream->error))
+  {
+    return FALSE;
+  }
+
+  g_string_truncate(stream->value, 0);
+  stream->func(stream, json_parser_get_root(stream->parser), stream->data);
+
+  return TRUE;
+}
+
+static gboolean
+fb_json_stream_fail(FbJsonStream *stream, const gchar *message)
+{
+  g_set_error_literal(&stream->error, JSON_PARSER_ERROR,
+                      JSON_PARSER_ERROR_PARSE, message);
+
+  return FALSE;
+}
+
+static gboolean
+fb_json_stream_scan(FbJsonStream *stream, const gchar *data, gssize size)
+{
+  /* start of the value in progress within @data */
+  gssize mark = 0;
+
+  for (gssize i = 0; i < size; i++)
+  {
+    gchar c = data[i];
+
+    if (!stream->in_value)
+    {
+      if (g_ascii_isspace(c))
+        continue;
+
+      if (stream->split_array)
+      {
+        if (!stream->opened)
+        {
+          if (c != '[')
+            return fb_json_stream_fail(stream, "Expected an array");
+
+          stream->opened = TRUE;
+          continue;
+        }
+
+        if (stream->closed)
+          return fb_json_stream_fail(stream, "Trailing data after array");
+
+        if (c == ',')
+          continue;
+
+        if (c == ']')
+        {
+          stream->closed = TRUE;
+          continue;
+        }
+      }
+
+      mark = i;
+      stream->in_value = TRUE;
+      stream->scalar = FALSE;
+      stream->depth = 0;
+
+      if (c == '{' || c == '[')
+        stream->depth = 1;
+      else if (c == '"')
+        stream->in_string = TRUE;
+      else
+        stream->scalar = TRUE;
+
+      continue;
+    }
+
+    if (stream->in_string)
+    {
+      if (stream->escaped)
+        stream->escaped = FALSE;
+      else if (c == '\\')
+        stream->escaped = TRUE;
+      else if (c == '"')
+      {
+        stream->in_string = FALSE;
+
+        if (!stream->depth &&
+            !fb_json_stream_emit(stream, data + mark, i + 1 - mark))
+        {
+          return FALSE;
+        }
+      }
+
+      continue;
+    }
+
+    if (stream->scalar)
+    {
+      if (g_ascii_isalnum(c) || c == '-' || c == '+' || c == '.')
+        continue;
+
+      /* the delimiter isn't part of the scalar, look at it again */
+      if (!fb_json_stream_emit(stream, data + mark, i - mark))
+        return FALSE;
+
+      i--;
+      continue;
+    }
+
+    switch (c)
+    {
+      case '"':
+        stream->in_string = TRUE;
+        break;
+      case '{':
+      case '[':
+        stream->depth++;
+        break;
+      case '}':
+      case ']':
+        if (!--stream->depth &&
+            !fb_json_stream_emit(stream, data + mark, i + 1 - mark))
+        {
+          return FALSE;
+        }
+
+        break;
+    }
+  }
+
+  if (stream->in_value)
+    g_string_append_len(stream->value, data + mark, size - mark);
+
+  return TRUE;
+}
+
+gboolean
+fb_json_stream_feed(FbJsonStream *stream, const gchar *data, gssize size,
+                    GError **error)
+{
+  g_return_val_if_fail(stream != NULL, FALSE);
+
+  if (size < 0)
+    size = strlen(data);
+
+  if (!stream->error)
+    fb_json_stream_scan(stream, data, size);
+
+  if (stream->error)
+  {
+    g_propagate_error(error, g_error_copy(stream->error));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+gboolean
+fb_json_stream_finish(FbJsonStream *stream, GError **error)
+{
+  g_return_val_if_fail(stream != NULL, FALSE);
+
+  /* a trailing scalar only ends with the stream */
+  if (!stream->error && stream->in_value && stream->scalar)
+    fb_json_stream_emit(stream, "", 0);
+
+  if (!stream->error &&
+      (stream->in_value || (stream->opened && !stream->closed)))
+  {
+    fb_json_stream_fail(stream, "Unexpected end of data");
+  }
+
+  if (stream->error)
+  {
+    g_propagate_error(error, g_error_copy(stream->error));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+fb_json_stream_chunk_cb(FbHttpRequest *req, const gchar *data, gsize size,
+                        gpointer user_data)
+{
+  /* errors are kept for fb_json_stream_finish() */
+  fb_json_stream_feed(user_data, data, size, NULL);
+}
+
+void
+fb_json_stream_attach(FbJsonStream *stream, FbHttpRequest *req)
+{
+  g_return_if_fail(stream != NULL);
+
+  fb_http_request_set_chunk_func(req, fb_json_stream_chunk_cb, stream);
+}
+
+void
+fb_json_stream_free(FbJsonStream *stream)
+{
+  g_return_if_fail(stream != NULL);
+
+  g_object_unref(stream->parser);
+  g_string_free(stream->value, TRUE);
+  g_clear_error(&stream->error);
+  g_slice_free(FbJsonStream, stream);
+}
@@ -0,0 +1,113 @@
+/*
+ * This file is part of telepathy-facebook
+ *
+ * Copyright (C) 2025 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef __FB_JSON_STREAM_H__
+#define __FB_JSON_STREAM_H__
+
+/**
+ * @file fb-json-stream.h
+ * @brief Incremental JSON consumer.
+ *
+ * Splits a byte stream into complete JSON values as the bytes come in and
+ * parses each one on its own, so a response never has to be held, or
+ * parsed, in one piece. The stream is either a sequence of values, like
+ * the batched GraphQL replies, or with @split_array set a single array
+ * whose elements are handed out one by one.
+ */
+
+#include <json-glib/json-glib.h>
+
+#include "fb-http-ext.h"
+
+G_BEGIN_DECLS
+
+typedef struct _FbJsonStream FbJsonStream;
+
+/**
+ * FbJsonStreamFunc:
+ * @stream: The #FbJsonStream.
+ * @root: (transfer none): The parsed value, only valid during the call.
+ * @data: The user-defined data.
+ *
+ * The type of callback complete values are handed to.
+ */
+typedef void (*FbJsonStreamFunc) (FbJsonStream *stream, JsonNode *root,
+                                  gpointer data);
+
+/**
+ * fb_json_stream_new:
+ * @split_array: TRUE to hand out the elements of a top level array.
+ * @func: The #FbJsonStreamFunc.
+ * @data: The user-defined data.
+ *
+ * @returns: The new #FbJsonStream.
+ */
+FbJsonStream *
+fb_json_stream_new(gboolean split_array, FbJsonStreamFunc func,
+                   gpointer data);
+
+/**
+ * fb_json_stream_feed:
+ * @stream: The #FbJsonStream.
+ * @data: The next bytes of the stream.
+ * @size: The size of @data, or -1 if it is nul-terminated.
+ * @error: The return location for the #GError or NULL.
+ *
+ * Calls the #FbJsonStreamFunc for every value @data completes. Once an
+ * error occurred the rest of the stream is ignored.
+ *
+ * @returns: TRUE on success, FALSE on error.
+ */
+gboolean
+fb_json_stream_feed(FbJsonStream *stream, const gchar *data, gssize size,
+                    GError **error);
+
+/**
+ * fb_json_stream_finish:
+ * @stream: The #FbJsonStream.
+ * @error: The return location for the #GError or NULL.
+ *
+ * Ends the stream, failing if it stopped in the middle of a value or ran
+ * into an error earlier.
+ *
+ * @returns: TRUE on success, FALSE on error.
+ */
+gboolean
+fb_json_stream_finish(FbJsonStream *stream, GError **error);
+
+/**
+ * fb_json_stream_attach:
+ * @stream: The #FbJsonStream.
+ * @req: The #FbHttpRequest.
+ *
+ * Streams the response body of @req into @stream, see
+ * fb_http_request_set_chunk_func(). The request callback should call
+ * fb_json_stream_finish().
+ */
+void
+fb_json_stream_attach(FbJsonStream *stream, FbHttpRequest *req);
+
+/**
+ * fb_json_stream_free:
+ * @stream: The #FbJsonStream.
+ */
+void
+fb_json_stream_free(FbJsonStream *stream);
+
+G_END_DECLS
+
+#endif /* __FB_JSON_STREAM_H__ */
@@ -33,6 +33,8 @@
 #include <fcntl.h>
 #include <errno.h>
 
+#include <gio/gio.h>
+
 #include "bitlbee.h"
 #include "proxy.h"
 #include "base64.h"
@@ -44,15 +46,23 @@ int proxytype = PROXY_NONE;
 char proxyuser[128] = "";
 char proxypass[128] = "";
 
-/* Some systems don't know this one. It's not essential, so set it to 0 then. */
-#ifndef AI_NUMERICSERV
-#define AI_NUMERICSERV 0
-#endif
-#ifndef AI_ADDRCONFIG
-#define AI_ADDRCONFIG 0
-#endif
+/* Neither getaddrinfo() nor GResolver tell how long an answer is valid, so
+ * cached answers live for a fixed time. Failures are remembered for less,
+ * long enough to keep a reconnect storm from hammering the resolver. */
+#define DNS_CACHE_TTL 300
+#define DNS_CACHE_NEGATIVE_TTL 30
+#define DNS_CACHE_MAX 64
+
+/* RFC 8305 Connection Attempt Delay, in ms */
+#define PROXY_ATTEMPT_DELAY 250
 
 static GHashTable *phb_hash = NULL;
+static GHashTable *dns_cache = NULL;
+
+struct dns_entry {
+	GList *addresses;       /* of GInetAddress, NULL for a failed lookup */
+	gint64 expires;
+};
 
 struct PHB {
 	b_event_handler func, proxy_func;
@@ -61,17 +71,282 @@ struct PHB {
 	int port;
 	int fd;
 	gint inpa;
-	struct addrinfo *gai, *gai_cur;
+	struct addrinfo *gai, *gai_next;
+	GSList *attempts;
+	gint stagger;
+	GCancellable *resolving;
+	unsigned short resolving_port;
+};
+
+/* one of the connects racing for phb */
+struct proxy_attempt {
+	struct PHB *phb;
+	int fd;
+	gint inpa;
+};
+
+struct dns_lookup {
+	struct PHB *phb;
+	char *host;
+	void (*func)(struct PHB *phb, GList *addresses);
 };
 
 typedef int (*proxy_connect_func)(const char *host, unsigned short port_, struct PHB *phb);
 
 static int proxy_connect_none(const char *host, unsigned short port_, struct PHB *phb);
 
+static void dns_entry_free(gpointer data)
+{
+	struct dns_entry *entry = data;
+
+	g_list_free_full(entry->addresses, g_object_unref);
+	g_free(entry);
+}
+
+static gboolean dns_entry_expired(gpointer key, gpointer value, gpointer now)
+{
+	return ((struct dns_entry *) value)->expires <= *(gint64 *) now;
+}
+
+/* returns TRUE if the answer is known without asking the resolver, with
+ * *addresses a new list, NULL if the host doesn't resolve */
+static gboolean dns_cache_lookup(const char *host, GList **addresses)
+{
+	GInetAddress *addr;
+	struct dns_entry *entry;
+	char *key;
+
+	*addresses = NULL;
+
+	if ((addr = g_inet_address_new_from_string(host))) {
+		*addresses = g_list_append(NULL, addr);
+		return TRUE;
+	}
+
+	if (!dns_cache) {
+		return FALSE;
+	}
+
+	key = g_ascii_strdown(host, -1);
+	entry = g_hash_table_lookup(dns_cache, key);
+	g_free(key);
+
+	if (!entry) {
+		return FALSE;
+	}
+
+	if (entry->expires <= g_get_monotonic_time()) {
+		return FALSE;
+	}
+
+	*addresses = g_list_copy_deep(entry->addresses, (GCopyFunc) g_object_ref, NULL);
+	return TRUE;
+}
+
+static void dns_cache_store(const char *host, GList *addresses)
+{
+	struct dns_entry *entry;
+	gint64 now = g_get_monotonic_time();
+
+	if (!dns_cache) {
+		dns_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, dns_entry_free);
+	}
+
+	if (g_hash_table_size(dns_cache) >= DNS_CACHE_MAX) {
+		g_hash_table_foreach_remove(dns_cache, dns_entry_expired, &now);
+	}
+	if (g_hash_table_size(dns_cache) >= DNS_CACHE_MAX) {
+		g_hash_table_remove_all(dns_cache);
+	}
+
+	entry = g_new0(struct dns_entry, 1);
+	entry->addresses = g_list_copy_deep(addresses, (GCopyFunc) g_object_ref, NULL);
+	entry->expires = now + (addresses ? DNS_CACHE_TTL : DNS_CACHE_NEGATIVE_TTL) * G_USEC_PER_SEC;
+
+	g_hash_table_replace(dns_cache, g_ascii_strdown(host, -1), entry);
+}
+
+static void dns_resolved(GObject *source, GAsyncResult *res, gpointer data)
+{
+	struct dns_lookup *lookup = data;
+	GError *error = NULL;
+	GList *addresses;
+
+	addresses = g_resolver_lookup_by_name_finish(G_RESOLVER(source), res, &error);
+
+	if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		/* the connection is gone already */
+		g_error_free(error);
+		g_free(lookup->host);
+		g_free(lookup);
+		return;
+	}
+
+	if (addresses) {
+		dns_cache_store(lookup->host, addresses);
+	} else {
+		event_debug("resolving %s failed: %s\n", lookup->host, error->message);
+
+		/* only remember answers, not a resolver that is having trouble */
+		if (g_error_matches(error, G_RESOLVER_ERROR, G_RESOLVER_ERROR_NOT_FOUND)) {
+			dns_cache_store(lookup->host, NULL);
+		}
+		g_error_free(error);
+	}
+
+	g_clear_object(&lookup->phb->resolving);
+	lookup->func(lookup->phb, addresses);
+
+	g_resolver_free_addresses(addresses);
+	g_free(lookup->host);
+	g_free(lookup);
+}
+
+/* resolves host off the main loop, func gets the addresses unless phb is
+ * freed first */
+static void dns_resolve(struct PHB *phb, const char *host, void (*func)(struct PHB *phb, GList *addresses))
+{
+	GResolver *resolver = g_resolver_get_default();
+	struct dns_lookup *lookup = g_new0(struct dns_lookup, 1);
+
+	lookup->phb = phb;
+	lookup->host = g_strdup(host);
+	lookup->func = func;
+
+	phb->resolving = g_cancellable_new();
+	g_resolver_lookup_by_name_async(resolver, host, phb->resolving, dns_resolved, lookup);
+	g_object_unref(resolver);
+}
+
+/* getaddrinfo() lookalike, to be freed with proxy_addrinfo_free() */
+static struct addrinfo *proxy_addrinfo_new(GList *addresses, unsigned short port_)
+{
+	struct addrinfo *head = NULL, **tail = &head;
+	GList *l;
+
+	for (l = addresses; l; l = l->next) {
+		GSocketAddress *sa = g_inet_socket_address_new(l->data, port_);
+		struct addrinfo *ai = g_malloc0(sizeof(struct addrinfo) + sizeof(struct sockaddr_storage));
+
+		ai->ai_addr = (struct sockaddr *) (ai + 1);
+
+		if (!g_socket_address_to_native(sa, ai->ai_addr, sizeof(struct sockaddr_storage), NULL)) {
+			g_object_unref(sa);
+			g_free(ai);
+			continue;
+		}
+
+		ai->ai_addrlen = g_socket_address_get_native_size(sa);
+		ai->ai_family = ai->ai_addr->sa_family;
+		ai->ai_socktype = SOCK_STREAM;
+		ai->ai_protocol = IPPROTO_TCP;
+		g_object_unref(sa);
+
+		*tail = ai;
+		tail = &ai->ai_next;
+	}
+
+	return head;
+}
+
+static void proxy_addrinfo_free(struct addrinfo *ai)
+{
+	while (ai) {
+		struct addrinfo *next = ai->ai_next;
+
+		g_free(ai);
+		ai = next;
+	}
+}
+
+/* alternates the address families, starting with the one the resolver put
+ * first, so a family that doesn't work only ever delays every other attempt */
+static struct addrinfo *proxy_addrinfo_interleave(struct addrinfo *list)
+{
+	struct addrinfo *first = NULL, **first_tail = &first;
+	struct addrinfo *other = NULL, **other_tail = &other;
+	struct addrinfo *head = NULL, **tail = &head;
+	struct addrinfo *ai;
+
+	if (!list) {
+		return NULL;
+	}
+
+	while ((ai = list)) {
+		list = ai->ai_next;
+		ai->ai_next = NULL;
+
+		if (!first || ai->ai_family == first->ai_family) {
+			*first_tail = ai;
+			first_tail = &ai->ai_next;
+		} else {
+			*other_tail = ai;
+			other_tail = &ai->ai_next;
+		}
+	}
+
+	while (first || other) {
+		if (first) {
+			ai = first;
+			first = ai->ai_next;
+			*tail = ai;
+			tail = &ai->ai_next;
+		}
+		if (other) {
+			ai = other;
+			other = ai->ai_next;
+			*tail = ai;
+			tail = &ai->ai_next;
+		}
+	}
+	*tail = NULL;
+
+	return head;
+}
+
+/* stops an attempt, keeping its socket open if the caller knows its fd */
+static void proxy_attempt_free(struct proxy_attempt *attempt)
+{
+	struct PHB *phb = attempt->phb;
+
+	phb->attempts = g_slist_remove(phb->attempts, attempt);
+
+	if (attempt->inpa > 0) {
+		b_event_remove(attempt->inpa);
+	}
+	if (attempt->fd != phb->fd) {
+		closesocket(attempt->fd);
+	}
+	g_free(attempt);
+}
+
+static void proxy_attempts_free(struct PHB *phb)
+{
+	if (phb->stagger > 0) {
+		b_event_remove(phb->stagger);
+		phb->stagger = 0;
+	}
+	while (phb->attempts) {
+		proxy_attempt_free(phb->attempts->data);
+	}
+	if (phb->gai) {
+		proxy_addrinfo_free(phb->gai);
+		phb->gai = NULL;
+		phb->gai_next = NULL;
+	}
+}
+
 static gboolean phb_free(struct PHB *phb, gboolean success)
 {
 	g_hash_table_remove(phb_hash, &phb->fd);
 
+	if (phb->resolving) {
+		g_cancellable_cancel(phb->resolving);
+		g_clear_object(&phb->resolving);
+	}
+
+	proxy_attempts_free(phb);
+
 	if (!success) {
 		if (phb->fd > 0) {
 			closesocket(phb->fd);
@@ -80,9 +355,6 @@ static gboolean phb_free(struct PHB *phb, gboolean success)
 			phb->func(phb->data, -1, B_EV_IO_READ);
 		}
 	}
-	if (phb->gai) {
-		freeaddrinfo(phb->gai);
-	}
 	g_free(phb->host);
 	g_free(phb);
 	return FALSE;
@@ -107,40 +379,51 @@ static gboolean phb_connected(struct PHB *phb, gint source)
 	return FALSE;
 }
 
+static gboolean proxy_attempt_start(struct PHB *phb);
+
 static gboolean proxy_connected(gpointer data, gint source, b_input_condition cond)
 {
-	struct PHB *phb = data;
+	struct proxy_attempt *attempt = data;
+	struct PHB *phb = attempt->phb;
 	socklen_t len;
 	int error = ETIMEDOUT;
 
 	len = sizeof(error);
 
 	if (getsockopt(source, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
-		if ((phb->gai_cur = phb->gai_cur->ai_next)) {
-			int new_fd;
-			b_event_remove(phb->inpa);
-			if ((new_fd = proxy_connect_none(NULL, 0, phb))) {
-				b_event_remove(phb->inpa);
-				closesocket(source);
-				dup2(new_fd, source);
-				closesocket(new_fd);
-				phb->fd = source;
-				phb->inpa = b_input_add(source, B_EV_IO_WRITE, proxy_connected, phb);
-				return FALSE;
-			}
+		event_debug("connect( %d ) failed: %s\n", source, strerror(error));
+		proxy_attempt_free(attempt);
+
+		/* no point in waiting for the timer, try the next one right away */
+		if (phb->stagger > 0) {
+			b_event_remove(phb->stagger);
+			phb->stagger = 0;
 		}
-		closesocket(source);
-		source = -1;
-		/* socket is dead, but continue to clean up */
-	} else {
-		sock_make_blocking(source);
+		proxy_attempt_start(phb);
+
+		if (!phb->attempts) {
+			/* nothing left to try */
+			phb_free(phb, FALSE);
+		}
+
+		return FALSE;
 	}
 
-	freeaddrinfo(phb->gai);
-	phb->gai = NULL;
+	/* this one won, the rest can go */
+	b_event_remove(attempt->inpa);
+	attempt->inpa = 0;
+	phb->attempts = g_slist_remove(phb->attempts, attempt);
+	proxy_attempts_free(phb);
 
-	b_event_remove(phb->inpa);
-	phb->inpa = 0;
+	if (attempt->fd != phb->fd) {
+		/* the caller only knows phb->fd */
+		dup2(attempt->fd, phb->fd);
+		closesocket(attempt->fd);
+	}
+	g_free(attempt);
+
+	source = phb->fd;
+	sock_make_blocking(source);
 
 	if (phb->proxy_func) {
 		phb->proxy_func(phb->proxy_data, source, B_EV_IO_READ);
@@ -151,39 +434,36 @@ static gboolean proxy_connected(gpointer data, gint source, b_input_condition co
 	return FALSE;
 }
 
-static int proxy_connect_none(const char *host, unsigned short port_, struct PHB *phb)
+static gboolean proxy_attempt_stagger(gpointer data, gint fd, b_input_condition cond)
 {
-	struct sockaddr_in me;
-	int fd = -1;
+	struct PHB *phb = data;
 
-	if (phb->gai_cur == NULL) {
-		int ret;
-		char port[6];
-		struct addrinfo hints;
+	phb->stagger = 0;
+	proxy_attempt_start(phb);
 
-		g_snprintf(port, sizeof(port), "%d", port_);
+	return FALSE;
+}
 
-		memset(&hints, 0, sizeof(struct addrinfo));
-		hints.ai_family = AF_UNSPEC;
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
+/* starts connecting to the next address that takes it, and schedules the
+ * attempt after it, RFC 8305 style. Returns FALSE if no attempt started. */
+static gboolean proxy_attempt_start(struct PHB *phb)
+{
+	struct sockaddr_in me;
+	struct addrinfo *ai;
+	struct proxy_attempt *attempt;
+	int fd = -1;
 
-		if (!(ret = getaddrinfo(host, port, &hints, &phb->gai))) {
-			phb->gai_cur = phb->gai;
-		} else {
-			event_debug("gai(): %s\n", gai_strerror(ret));
-		}
-	}
+	while ((ai = phb->gai_next)) {
+		phb->gai_next = ai->ai_next;
 
-	for (; phb->gai_cur; phb->gai_cur = phb->gai_cur->ai_next) {
-		if ((fd = socket(phb->gai_cur->ai_family, phb->gai_cur->ai_socktype, phb->gai_cur->ai_protocol)) < 0) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
 			event_debug("socket failed: %d\n", errno);
 			continue;
 		}
 
 		sock_make_nonblocking(fd);
 
-		if (global.conf->iface_out) {
+		if (global.conf->iface_out && ai->ai_family == AF_INET) {
 			me.sin_family = AF_INET;
 			me.sin_port = 0;
 			me.sin_addr.s_addr = inet_addr(global.conf->iface_out);
@@ -193,28 +473,96 @@ static int proxy_connect_none(const char *host, unsigned short port_, struct PHB
 			}
 		}
 
-		event_debug("proxy_connect_none( \"%s\", %d ) = %d\n", host, port_, fd);
+		event_debug("proxy_attempt_start( family %d ) = %d\n", ai->ai_family, fd);
 
-		if (connect(fd, phb->gai_cur->ai_addr, phb->gai_cur->ai_addrlen) < 0 && !sockerr_again()) {
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 && !sockerr_again()) {
 			event_debug("connect failed: %s\n", strerror(errno));
 			closesocket(fd);
 			fd = -1;
 			continue;
-		} else {
-			phb->inpa = b_input_add(fd, B_EV_IO_WRITE, proxy_connected, phb);
-			phb->fd = fd;
-
-			break;
 		}
+
+		break;
+	}
+
+	if (fd < 0) {
+		return FALSE;
+	}
+
+	/* the first socket is the fd proxy_connect() returns */
+	if (phb->fd < 0) {
+		phb->fd = fd;
 	}
 
-	if (fd < 0 && host) {
+	attempt = g_new0(struct proxy_attempt, 1);
+	attempt->phb = phb;
+	attempt->fd = fd;
+	attempt->inpa = b_input_add(fd, B_EV_IO_WRITE, proxy_connected, attempt);
+	phb->attempts = g_slist_append(phb->attempts, attempt);
+
+	if (phb->gai_next) {
+		phb->stagger = b_timeout_add(PROXY_ATTEMPT_DELAY, proxy_attempt_stagger, phb);
+	}
+
+	return TRUE;
+}
+
+static void proxy_resolved_none(struct PHB *phb, GList *addresses)
+{
+	phb->gai = proxy_addrinfo_interleave(proxy_addrinfo_new(addresses, phb->resolving_port));
+	phb->gai_next = phb->gai;
+
+	/* phb->fd is the placeholder, whichever attempt wins takes its place */
+	if (!proxy_attempt_start(phb)) {
+		phb_free(phb, FALSE);
+	}
+}
+
+/* proxy_connect() has to return an fd right away, so hand out a socket to
+ * stand in for the real one until the host is resolved */
+static int proxy_resolve_none(const char *host, unsigned short port_, struct PHB *phb)
+{
+	int fd;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		event_debug("socket failed: %d\n", errno);
 		phb_free(phb, TRUE);
+		return -1;
 	}
 
+	phb->fd = fd;
+	phb->resolving_port = port_;
+	dns_resolve(phb, host, proxy_resolved_none);
+
 	return fd;
 }
 
+static int proxy_connect_none(const char *host, unsigned short port_, struct PHB *phb)
+{
+	GList *addresses;
+
+	if (!dns_cache_lookup(host, &addresses)) {
+		return proxy_resolve_none(host, port_, phb);
+	}
+
+	if (!addresses) {
+		event_debug("%s is known not to resolve\n", host);
+	}
+
+	phb->gai = proxy_addrinfo_interleave(proxy_addrinfo_new(addresses, port_));
+	phb->gai_next = phb->gai;
+	g_resolver_free_addresses(addresses);
+
+	event_debug("proxy_connect_none( \"%s\", %d )\n", host, port_);
+
+	if (!proxy_attempt_start(phb)) {
+		phb_free(phb, TRUE);
+		return -1;
+	}
+
+	return phb->fd;
+}
+
 
 /* Connecting to HTTP proxies */
 
@@ -319,27 +667,11 @@ static gboolean s4_canread(gpointer data, gint source, b_input_condition cond)
 	return phb_free(phb, FALSE);
 }
 
-static gboolean s4_canwrite(gpointer data, gint source, b_input_condition cond)
+static void s4_sendconnect(struct PHB *phb, GList *addresses)
 {
 	unsigned char packet[12];
-	struct hostent *hp;
-	struct PHB *phb = data;
-	socklen_t len;
-	int error = ETIMEDOUT;
 	gboolean is_socks4a = (proxytype == PROXY_SOCKS4A);
-
-	if (phb->inpa > 0) {
-		b_event_remove(phb->inpa);
-	}
-	len = sizeof(error);
-	if (getsockopt(source, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
-		return phb_free(phb, FALSE);
-	}
-	sock_make_blocking(source);
-
-	if (!is_socks4a && !(hp = gethostbyname(phb->host))) {
-		return phb_free(phb, FALSE);
-	}
+	int source = phb->fd;
 
 	packet[0] = 4;
 	packet[1] = 1;
@@ -351,25 +683,62 @@ static gboolean s4_canwrite(gpointer data, gint source, b_input_condition cond)
 		packet[6] = 0;
 		packet[7] = 1;
 	} else {
-		packet[4] = (unsigned char) (hp->h_addr_list[0])[0];
-		packet[5] = (unsigned char) (hp->h_addr_list[0])[1];
-		packet[6] = (unsigned char) (hp->h_addr_list[0])[2];
-		packet[7] = (unsigned char) (hp->h_addr_list[0])[3];
+		GList *l;
+
+		/* SOCKS4 only does IPv4 */
+		for (l = addresses; l; l = l->next) {
+			if (g_inet_address_get_family(l->data) == G_SOCKET_FAMILY_IPV4) {
+				break;
+			}
+		}
+		if (!l) {
+			phb_free(phb, FALSE);
+			return;
+		}
+		memcpy(packet + 4, g_inet_address_to_bytes(l->data), 4);
 	}
 	packet[8] = 0;
 	if (write(source, packet, 9) != 9) {
-		return phb_free(phb, FALSE);
+		phb_free(phb, FALSE);
+		return;
 	}
 
 	if (is_socks4a) {
 		size_t host_len = strlen(phb->host) + 1; /* include the \0 */
 
 		if (write(source, phb->host, host_len) != host_len) {
-			return phb_free(phb, FALSE);
+			phb_free(phb, FALSE);
+			return;
 		}
 	}
 
 	phb->inpa = b_input_add(source, B_EV_IO_READ, s4_canread, phb);
+}
+
+static gboolean s4_canwrite(gpointer data, gint source, b_input_condition cond)
+{
+	struct PHB *phb = data;
+	GList *addresses;
+	socklen_t len;
+	int error = ETIMEDOUT;
+
+	if (phb->inpa > 0) {
+		b_event_remove(phb->inpa);
+	}
+	len = sizeof(error);
+	if (getsockopt(source, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+		return phb_free(phb, FALSE);
+	}
+	sock_make_blocking(source);
+
+	if (proxytype == PROXY_SOCKS4A) {
+		s4_sendconnect(phb, NULL);
+	} else if (dns_cache_lookup(phb->host, &addresses)) {
+		s4_sendconnect(phb, addresses);
+		g_resolver_free_addresses(addresses);
+	} else {
+		dns_resolve(phb, phb->host, s4_sendconnect);
+	}
 
 	return FALSE;
 }
@@ -555,6 +924,7 @@ int proxy_connect(const char *host, int port, b_event_handler func, gpointer dat
 	}
 
 	phb = g_new0(struct PHB, 1);
+	phb->fd = -1;
 	phb->func = func;
 	phb->data = data;
 
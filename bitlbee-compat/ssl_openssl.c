@@ -33,6 +33,7 @@
 #include "bitlbee.h"
 #include "proxy.h"
 #include "ssl_client.h"
+#include "fb-capture.h"
 #include "sock.h"
 
 int ssl_errno = 0;
@@ -79,11 +80,32 @@ void ssl_init(void)
 	initialized = TRUE;
 }
 
+/* FACEBOOK_MQTT_SERVER=host:port sends the MQTT connection to a stand-in,
+   see tools/fb-mock-server */
+static char *ssl_connect_override(const char *host, int *port)
+{
+	const char *server = g_getenv("FACEBOOK_MQTT_SERVER");
+	const char *colon;
+
+	if (!server || !*server) {
+		return g_strdup(host);
+	}
+
+	if ((colon = strrchr(server, ':'))) {
+		*port = (int)g_ascii_strtoull(colon + 1, NULL, 10);
+		return g_strndup(server, colon - server);
+	}
+
+	return g_strdup(server);
+}
+
 void *ssl_connect(char *host, int port, gboolean verify, ssl_input_function func, gpointer data)
 {
 	struct scd *conn = g_new0(struct scd, 1);
+	char *target = ssl_connect_override(host, &port);
 
-	conn->fd = proxy_connect(host, port, ssl_connected, conn);
+	conn->fd = proxy_connect(target, port, ssl_connected, conn);
+	g_free(target);
 	if (conn->fd < 0) {
 		ssl_conn_free(conn);
 		return NULL;
@@ -239,6 +261,10 @@ int ssl_read(void *conn, char *buf, int len)
 		write(1, buf, st);
 	}
 
+	if (st > 0) {
+		fb_capture_mqtt(TRUE, buf, st);
+	}
+
 	return st;
 }
 
@@ -257,6 +283,10 @@ int ssl_write(void *conn, const char *buf, int len)
 		write(1, buf, st);
 	}
 
+	if (st > 0) {
+		fb_capture_mqtt(FALSE, buf, st);
+	}
+
 	ssl_errno = SSL_OK;
 	if (st <= 0) {
 		((struct scd*) conn)->lasterr = SSL_get_error(((struct scd*) conn)->ssl, st);
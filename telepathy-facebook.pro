@@ -30,6 +30,9 @@ SOURCES += \
     bitlbee-compat/base64.c \
     bitlbee-compat/events_glib.c \
     bitlbee-compat/facebook-http.c \
+    bitlbee-compat/fb-capture.c \
+    bitlbee-compat/fb-http-stats.c \
+    bitlbee-compat/fb-http-trace.c \
     bitlbee-compat/fb-http-values.c \
     bitlbee-compat/proxy.c \
     bitlbee-compat/ssl_openssl.c
@@ -37,6 +40,7 @@ SOURCES += \
 SOURCES += \
     tp/account-verify-channel.c \
     tp/account-verify-manager.c \
+    tp/avatar-cache.c \
     tp/avatars.c \
     tp/connection-manager.c \
     tp/connection.c \
@@ -48,6 +52,7 @@ SOURCES += \
     tp/protocol.c
 
 HEADERS += \
+    tp/avatar-cache.h \
     tp/avatars.h \
     tp/connection-data.h \
     tp/connection-manager.h \
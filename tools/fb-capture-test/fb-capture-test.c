@@ -0,0 +1,117 @@
+/*
+ * This file is part of telepathy-facebook
+ *
+ * Copyright (C) 2025 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that nothing secret makes it through the capture scrubbing. */
+
+#include <string.h>
+
+#include "fb-capture.h"
+
+static void
+assert_scrubbed(const gchar *json, const gchar *const *kept)
+{
+  gchar *scrubbed = fb_capture_scrub_json(json, strlen(json), NULL);
+
+  g_assert_nonnull(scrubbed);
+  g_assert_null(strstr(scrubbed, "SECRET"));
+
+  for (; kept && *kept; kept++)
+    g_assert_nonnull(strstr(scrubbed, *kept));
+
+  g_free(scrubbed);
+}
+
+static void
+test_json_strings(void)
+{
+  const gchar *kept[] = {"\"uid\"", "1234", "\"machine_id\"", NULL};
+
+  assert_scrubbed("{\"uid\":1234,\"access_token\":\"SECRET\","
+                  "\"password\" : \"SECRET\\\"SECRET\","
+                  "\"machine_id\":\"SECRET\"}", kept);
+}
+
+static void
+test_json_cookie_array(void)
+{
+  const gchar *kept[] = {"\"session_cookies\"", "\"identifier\"", NULL};
+
+  assert_scrubbed("{\"session_key\":\"SECRET\",\"secret\":\"SECRET\","
+                  "\"identifier\":\"someone\","
+                  "\"session_cookies\":[{\"name\":\"c_user\","
+                  "\"value\":\"SECRET\"},{\"name\":\"xs\","
+                  "\"value\":\"SECRET\",\"secret\":\"SECRET\"}]}", kept);
+}
+
+static void
+test_json_nested(void)
+{
+  const gchar *kept[] = {"\"data\"", "\"viewer\"", NULL};
+
+  assert_scrubbed("[{\"data\":{\"viewer\":{\"credentials\":"
+                  "{\"token\":\"SECRET\"},\"sig\":42}}}]", kept);
+}
+
+static void
+test_json_other(void)
+{
+  const gchar *html = "<html>access_token</html>";
+  const gchar *broken = "{\"access_token\":\"SECRET";
+  gchar *scrubbed;
+
+  g_assert_null(fb_capture_scrub_json(html, strlen(html), NULL));
+
+  g_test_expect_message(NULL, G_LOG_LEVEL_MESSAGE, "Dropped a * JSON body*");
+  scrubbed = fb_capture_scrub_json(broken, strlen(broken), NULL);
+  g_test_assert_expected_messages();
+  g_assert_cmpstr(scrubbed, ==, "");
+  g_free(scrubbed);
+}
+
+static void
+test_form(void)
+{
+  const gchar *form = "email=someone&password=SECRET&format=json&sig=SECRET";
+  gchar *scrubbed;
+  gsize len;
+
+  scrubbed = fb_capture_scrub_form(form, strlen(form), &len);
+  g_assert_cmpstr(scrubbed, ==, "email=&password=&format=json&sig=");
+  g_assert_cmpuint(len, ==, strlen(scrubbed));
+  g_free(scrubbed);
+
+  scrubbed = fb_capture_scrub_url("https://b-api.facebook.com/method/"
+                                  "auth.login?access_token=SECRET&locale=en");
+  g_assert_cmpstr(scrubbed, ==, "https://b-api.facebook.com/method/"
+                  "auth.login?access_token=&locale=en");
+  g_free(scrubbed);
+}
+
+int
+main(int argc, char **argv)
+{
+  g_test_init(&argc, &argv, NULL);
+
+  g_test_add_func("/capture/json/strings", test_json_strings);
+  g_test_add_func("/capture/json/cookie-array", test_json_cookie_array);
+  g_test_add_func("/capture/json/nested", test_json_nested);
+  g_test_add_func("/capture/json/other", test_json_other);
+  g_test_add_func("/capture/form", test_form);
+
+  return g_test_run();
+}
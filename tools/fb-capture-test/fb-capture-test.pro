@@ -0,0 +1,14 @@
+TEMPLATE = app
+CONFIG -= console
+CONFIG -= app_bundle
+CONFIG -= qt
+
+CONFIG += link_pkgconfig
+
+PKGCONFIG += gio-2.0 json-glib-1.0
+
+INCLUDEPATH += ../../bitlbee-compat
+
+SOURCES += \
+    ../../bitlbee-compat/fb-capture.c \
+    fb-capture-test.c
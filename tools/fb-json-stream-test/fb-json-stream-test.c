@@ -0,0 +1,177 @@
+/*
+ * This file is part of telepathy-facebook
+ *
+ * Copyright (C) 2025 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that values come out of the stream the same, whatever the chunks
+ * the bytes arrive in. */
+
+#include <string.h>
+
+#include "fb-json-stream.h"
+
+/* fb_json_stream_attach() only hands the chunk callback over, keep it so the
+ * tests can play the request without a session */
+static FbHttpChunkFunc chunk_func;
+static gpointer chunk_data;
+
+void
+fb_http_request_set_chunk_func(FbHttpRequest *req, FbHttpChunkFunc func,
+                               gpointer user_data)
+{
+  chunk_func = func;
+  chunk_data = user_data;
+}
+
+static void
+collect_cb(FbJsonStream *stream, JsonNode *root, gpointer data)
+{
+  g_ptr_array_add(data, json_to_string(root, FALSE));
+}
+
+/* feeds @json @step bytes at a time, or through the chunk callback */
+static GPtrArray *
+parse(const gchar *json, gboolean split_array, gsize step, gboolean attach,
+      GError **error)
+{
+  GPtrArray *values = g_ptr_array_new_with_free_func(g_free);
+  FbJsonStream *stream = fb_json_stream_new(split_array, collect_cb, values);
+  gsize len = strlen(json);
+  gboolean ret = TRUE;
+
+  if (attach)
+    fb_json_stream_attach(stream, NULL);
+
+  for (gsize i = 0; ret && i < len; i += step)
+  {
+    gsize size = MIN(step, len - i);
+
+    if (attach)
+      chunk_func(NULL, json + i, size, chunk_data);
+    else
+      ret = fb_json_stream_feed(stream, json + i, size, error);
+  }
+
+  if (ret)
+    ret = fb_json_stream_finish(stream, error);
+
+  fb_json_stream_free(stream);
+
+  if (!ret)
+    g_clear_pointer(&values, g_ptr_array_unref);
+
+  return values;
+}
+
+static void
+assert_values(const gchar *json, gboolean split_array,
+              const gchar *const *expected)
+{
+  gsize len = strlen(json);
+
+  for (gsize step = 1; step <= len; step++)
+  {
+    GError *error = NULL;
+    GPtrArray *values = parse(json, split_array, step, step == len, &error);
+    guint i;
+
+    g_assert_no_error(error);
+
+    for (i = 0; i < values->len && expected[i]; i++)
+      g_assert_cmpstr(values->pdata[i], ==, expected[i]);
+
+    g_assert_cmpuint(i, ==, values->len);
+    g_assert_null(expected[i]);
+    g_ptr_array_unref(values);
+  }
+}
+
+static void
+assert_error(const gchar *json, gboolean split_array)
+{
+  GError *error = NULL;
+
+  g_assert_null(parse(json, split_array, 1, FALSE, &error));
+  g_assert_nonnull(error);
+  g_assert_cmpuint(error->domain, ==, JSON_PARSER_ERROR);
+  g_error_free(error);
+}
+
+static void
+test_sequence(void)
+{
+  const gchar *expected[] =
+  {
+    "{\"a\":\"}{\\\"\",\"b\":[1,2]}",
+    "[{}]",
+    "\"x]\"",
+    "42",
+    "true",
+    NULL
+  };
+
+  assert_values(" {\"a\": \"}{\\\"\", \"b\": [1, 2]}\n[{}]\"x]\" 42 true",
+                FALSE, expected);
+}
+
+static void
+test_split_array(void)
+{
+  const gchar *expected[] =
+  {
+    "{\"id\":1}",
+    "-15",
+    "\"a,b\"",
+    "[]",
+    "null",
+    NULL
+  };
+
+  assert_values("[ {\"id\": 1}, -15,\"a,b\" ,[] , null ]\n",
+                TRUE, expected);
+}
+
+static void
+test_empty(void)
+{
+  const gchar *expected[] = {NULL};
+
+  assert_values("[]", TRUE, expected);
+  assert_values(" \n", FALSE, expected);
+}
+
+static void
+test_errors(void)
+{
+  assert_error("{\"a\":1", FALSE);
+  assert_error("[{\"a\":1}", TRUE);
+  assert_error("{\"a\":}", FALSE);
+  assert_error("{}", TRUE);
+  assert_error("[] 1", TRUE);
+}
+
+int
+main(int argc, char **argv)
+{
+  g_test_init(&argc, &argv, NULL);
+
+  g_test_add_func("/json-stream/sequence", test_sequence);
+  g_test_add_func("/json-stream/split-array", test_split_array);
+  g_test_add_func("/json-stream/empty", test_empty);
+  g_test_add_func("/json-stream/errors", test_errors);
+
+  return g_test_run();
+}
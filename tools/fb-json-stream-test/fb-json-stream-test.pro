@@ -0,0 +1,16 @@
+TEMPLATE = app
+CONFIG -= console
+CONFIG -= app_bundle
+CONFIG -= qt
+
+CONFIG += link_pkgconfig
+
+PKGCONFIG += gio-2.0 json-glib-1.0 libsoup-2.4
+
+DEFINES += _GNU_SOURCE
+
+INCLUDEPATH += ../../bitlbee-compat ../../bitlbee-facebook/facebook
+
+SOURCES += \
+    ../../bitlbee-compat/fb-json-stream.c \
+    fb-json-stream-test.c
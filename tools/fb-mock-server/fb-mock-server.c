@@ -0,0 +1,685 @@
+/*
+ * This file is part of telepathy-facebook
+ *
+ * Copyright (C) 2025 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Stands in for the Facebook servers, so the connection manager can log in
+ * without a network. Point it here with
+ *
+ *   FACEBOOK_API_SERVER=http://127.0.0.1:8080
+ *   FACEBOOK_MQTT_SERVER=127.0.0.1:8883
+ *
+ * Responses come either from a capture made with FACEBOOK_CAPTURE, see
+ * fb-capture.h, passed with --replay, or from the --data directory:
+ *
+ *   http/<path>             body served for <path>, whatever the host
+ *   http/graphql/<query_id> body served for a graph query
+ *   <any of the above>.status
+ *                           optional, the status to answer with, 200 if
+ *                           missing
+ *   mqtt                    raw packets the broker sent, starting with
+ *                           CONNACK, replayed once the client connects
+ *
+ * A replay answers requests in the order they were captured, the last
+ * answer for a request repeats once they run out. Responses are delayed
+ * and MQTT packets spaced as they were, divided by --speed, 0 sends
+ * everything right away.
+ *
+ * MQTT needs --cert and --key, the client does not verify them. Both
+ * endpoints only listen on the loopback interface.
+ */
+
+#include <string.h>
+
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+
+#include "fb-capture.h"
+
+#define FB_MOCK_MQTT_CONNECT 1
+#define FB_MOCK_MQTT_PINGREQ 12
+#define FB_MOCK_MQTT_DISCONNECT 14
+
+static gchar *data_dir = NULL;
+static gchar *replay_file = NULL;
+static gdouble speed = 1.0;
+static gint http_port = 8080;
+static gint mqtt_port = 8883;
+static gchar *cert_file = NULL;
+static gchar *key_file = NULL;
+
+static GOptionEntry entries[] =
+{
+  { "data", 'd', 0, G_OPTION_ARG_FILENAME, &data_dir,
+    "Directory with the recorded responses", "DIR" },
+  { "replay", 'r', 0, G_OPTION_ARG_FILENAME, &replay_file,
+    "Capture to replay instead", "FILE" },
+  { "speed", 's', 0, G_OPTION_ARG_DOUBLE, &speed,
+    "Replay speed, 1 by default, 0 for no delays", "FACTOR" },
+  { "http-port", 'p', 0, G_OPTION_ARG_INT, &http_port,
+    "Port to serve HTTP on, 8080 by default", "PORT" },
+  { "mqtt-port", 'm', 0, G_OPTION_ARG_INT, &mqtt_port,
+    "Port to serve MQTT on, 8883 by default", "PORT" },
+  { "cert", 'c', 0, G_OPTION_ARG_FILENAME, &cert_file,
+    "TLS certificate of the MQTT endpoint", "FILE" },
+  { "key", 'k', 0, G_OPTION_ARG_FILENAME, &key_file,
+    "TLS key of the MQTT endpoint", "FILE" },
+  { NULL }
+};
+
+struct _FbMockFrame
+{
+  /* microseconds after the first one */
+  gint64 time;
+  GBytes *data;
+};
+
+typedef struct _FbMockFrame FbMockFrame;
+
+/* what the broker sends, in order */
+static GPtrArray *mqtt_frames = NULL;
+
+/* "<method> <path>[/<query_id>]" -> GQueue of FB_CAPTURE_HTTP_TYPE */
+static GHashTable *replay_http = NULL;
+
+struct _FbMockMqttConn
+{
+  GIOStream *tls;
+  /* held while writing */
+  GMutex lock;
+  GCond cond;
+  gboolean stop;
+};
+
+typedef struct _FbMockMqttConn FbMockMqttConn;
+
+struct _FbMockDelayed
+{
+  SoupServer *server;
+  SoupMessage *msg;
+};
+
+typedef struct _FbMockDelayed FbMockDelayed;
+
+static gint64
+fb_mock_scale(gint64 time)
+{
+  return speed > 0 ? time / speed : 0;
+}
+
+static gchar *
+fb_mock_form_get(const gchar *form, gsize size, const gchar *name)
+{
+  gchar *str = g_strndup(form, size);
+  GHashTable *values = soup_form_decode(str);
+  gchar *ret = g_strdup(g_hash_table_lookup(values, name));
+
+  g_hash_table_destroy(values);
+  g_free(str);
+
+  return ret;
+}
+
+/* graph queries all go to the same path, the query tells them apart */
+static gchar *
+fb_mock_http_key(const gchar *method, const gchar *path, const gchar *query,
+                 const gchar *body, gsize size)
+{
+  gchar *query_id = NULL;
+  gchar *ret;
+
+  if (query)
+    query_id = fb_mock_form_get(query, strlen(query), "query_id");
+
+  if (!query_id && body && size)
+    query_id = fb_mock_form_get(body, size, "query_id");
+
+  ret = g_strdup_printf("%s %s%s%s", method, path, query_id ? "/" : "",
+                        query_id ? query_id : "");
+  g_free(query_id);
+
+  return ret;
+}
+
+static void
+fb_mock_frame_add(gint64 time, GBytes *data)
+{
+  FbMockFrame *frame = g_new0(FbMockFrame, 1);
+
+  frame->time = time;
+  frame->data = data;
+  g_ptr_array_add(mqtt_frames, frame);
+}
+
+static void
+fb_mock_frame_free(gpointer data)
+{
+  FbMockFrame *frame = data;
+
+  g_bytes_unref(frame->data);
+  g_free(frame);
+}
+
+static void
+fb_mock_queue_free(gpointer data)
+{
+  g_queue_free_full(data, (GDestroyNotify)g_variant_unref);
+}
+
+static void
+fb_mock_replay_add_http(GVariant *record)
+{
+  const gchar *method;
+  const gchar *url;
+  GVariant *request;
+  SoupURI *uri;
+  gchar *key;
+  GQueue *queue;
+
+  g_variant_get(record, "(&s&s@ayu@ayx)", &method, &url, &request, NULL,
+                NULL, NULL);
+
+  if ((uri = soup_uri_new(url)))
+  {
+    gsize size;
+    gconstpointer body = g_variant_get_fixed_array(request, &size, 1);
+
+    key = fb_mock_http_key(method, uri->path, uri->query, body, size);
+
+    if (!(queue = g_hash_table_lookup(replay_http, key)))
+    {
+      queue = g_queue_new();
+      g_hash_table_insert(replay_http, g_strdup(key), queue);
+    }
+
+    g_queue_push_tail(queue, g_variant_ref(record));
+    g_free(key);
+    soup_uri_free(uri);
+  }
+
+  g_variant_unref(request);
+}
+
+static gboolean
+fb_mock_replay_load(GError **error)
+{
+  FbCaptureReader *reader;
+  FbCaptureRecord record;
+  GError *local = NULL;
+  gint64 first = -1;
+
+  if (!(reader = fb_capture_reader_new(replay_file, error)))
+    return FALSE;
+
+  replay_http = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                      fb_mock_queue_free);
+
+  while (fb_capture_reader_next(reader, &record, &local))
+  {
+    if (record.kind == FB_CAPTURE_HTTP)
+      fb_mock_replay_add_http(record.data);
+    else if (record.kind == FB_CAPTURE_MQTT_IN)
+    {
+      if (first < 0)
+        first = record.time;
+
+      fb_mock_frame_add(record.time - first,
+                        g_variant_get_data_as_bytes(record.data));
+    }
+
+    g_variant_unref(record.data);
+  }
+
+  fb_capture_reader_free(reader);
+
+  if (local)
+  {
+    g_propagate_error(error, local);
+    return FALSE;
+  }
+
+  g_message("replaying %u endpoints and %u MQTT packets",
+            g_hash_table_size(replay_http), mqtt_frames->len);
+
+  return TRUE;
+}
+
+static void
+fb_mock_data_load(void)
+{
+  gchar *file = g_build_filename(data_dir, "mqtt", NULL);
+  gchar *contents;
+  gsize length;
+
+  if (g_file_get_contents(file, &contents, &length, NULL))
+    fb_mock_frame_add(0, g_bytes_new_take(contents, length));
+  else
+    g_message("no MQTT recording at %s, clients only get PINGRESP", file);
+
+  g_free(file);
+}
+
+static guint
+fb_mock_http_status(const gchar *file)
+{
+  gchar *name = g_strconcat(file, ".status", NULL);
+  gchar *contents;
+  guint status = SOUP_STATUS_OK;
+
+  if (g_file_get_contents(name, &contents, NULL, NULL))
+  {
+    status = g_ascii_strtoull(contents, NULL, 10);
+    g_free(contents);
+  }
+
+  g_free(name);
+
+  return status;
+}
+
+static void
+fb_mock_http_respond(SoupMessage *msg, guint status, const gchar *name,
+                     SoupMemoryUse use, gconstpointer data, gsize length)
+{
+  gchar *type = g_content_type_guess(name, data, length, NULL);
+  gchar *mime = g_content_type_get_mime_type(type);
+
+  soup_message_set_status(msg, status);
+  soup_message_set_response(msg, mime ? mime : "application/octet-stream",
+                            use, data, length);
+
+  g_free(mime);
+  g_free(type);
+}
+
+static void
+fb_mock_http_serve_data(SoupMessage *msg, const gchar *path,
+                        GHashTable *query)
+{
+  const gchar *query_id = query ? g_hash_table_lookup(query, "query_id") :
+                                  NULL;
+  gchar *form_query_id = NULL;
+  gchar *file;
+  gchar *contents;
+  gsize length;
+
+  if (!query_id && msg->method == SOUP_METHOD_POST)
+  {
+    query_id = form_query_id = fb_mock_form_get(msg->request_body->data,
+                                                msg->request_body->length,
+                                                "query_id");
+  }
+
+  if (strstr(path, "..") || (query_id && strchr(query_id, '/')))
+  {
+    soup_message_set_status(msg, SOUP_STATUS_FORBIDDEN);
+    g_free(form_query_id);
+    return;
+  }
+
+  file = g_build_filename(data_dir, "http", path, query_id, NULL);
+
+  if (g_file_get_contents(file, &contents, &length, NULL))
+  {
+    fb_mock_http_respond(msg, fb_mock_http_status(file), file,
+                         SOUP_MEMORY_TAKE, contents, length);
+  }
+  else
+  {
+    g_message("%s %s: no recording at %s", msg->method, path, file);
+    soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+  }
+
+  g_free(file);
+  g_free(form_query_id);
+}
+
+static gboolean
+fb_mock_http_delayed_cb(gpointer user_data)
+{
+  FbMockDelayed *delayed = user_data;
+
+  soup_server_unpause_message(delayed->server, delayed->msg);
+  g_object_unref(delayed->msg);
+  g_free(delayed);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+fb_mock_http_serve_replay(SoupServer *server, SoupMessage *msg,
+                          const gchar *path)
+{
+  SoupURI *uri = soup_message_get_uri(msg);
+  GQueue *queue;
+  GVariant *record;
+  GVariant *response;
+  gchar *key;
+  guint status;
+  gint64 duration;
+  gsize size;
+  gconstpointer body;
+
+  key = fb_mock_http_key(msg->method, path, uri->query,
+                         msg->request_body->data, msg->request_body->length);
+  queue = g_hash_table_lookup(replay_http, key);
+
+  if (!queue)
+  {
+    g_message("%s: not in the capture", key);
+    soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+    g_free(key);
+    return;
+  }
+
+  g_free(key);
+
+  /* the last answer sticks */
+  if (g_queue_get_length(queue) > 1)
+    record = g_queue_pop_head(queue);
+  else
+    record = g_variant_ref(g_queue_peek_head(queue));
+
+  g_variant_get(record, "(&s&s@ayu@ayx)", NULL, NULL, NULL, &status,
+                &response, &duration);
+  body = g_variant_get_fixed_array(response, &size, 1);
+  fb_mock_http_respond(msg, status, path, SOUP_MEMORY_COPY, body, size);
+  g_variant_unref(response);
+  g_variant_unref(record);
+
+  if ((duration = fb_mock_scale(duration)) > 0)
+  {
+    FbMockDelayed *delayed = g_new0(FbMockDelayed, 1);
+
+    delayed->server = server;
+    delayed->msg = g_object_ref(msg);
+    soup_server_pause_message(server, msg);
+    g_timeout_add(duration / 1000, fb_mock_http_delayed_cb, delayed);
+  }
+}
+
+static void
+fb_mock_http_cb(SoupServer *server, SoupMessage *msg, const char *path,
+                GHashTable *query, SoupClientContext *client,
+                gpointer user_data)
+{
+  if (replay_http)
+    fb_mock_http_serve_replay(server, msg, path);
+  else
+    fb_mock_http_serve_data(msg, path, query);
+}
+
+/* reads the next packet, all we need of it is the type */
+static gboolean
+fb_mock_mqtt_read(GInputStream *in, guint *type, GError **error)
+{
+  guint8 byte;
+  gsize size = 0;
+  guint shift = 0;
+  gsize n;
+
+  if (!g_input_stream_read_all(in, &byte, 1, &n, NULL, error) || !n)
+    return FALSE;
+
+  *type = byte >> 4;
+
+  do
+  {
+    if (!g_input_stream_read_all(in, &byte, 1, &n, NULL, error) || !n)
+      return FALSE;
+
+    size |= (gsize)(byte & 0x7f) << shift;
+    shift += 7;
+  }
+  while ((byte & 0x80) && shift < 28);
+
+  while (size > 0)
+  {
+    gssize skipped = g_input_stream_skip(in, size, NULL, error);
+
+    if (skipped <= 0)
+      return FALSE;
+
+    size -= skipped;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+fb_mock_mqtt_write(FbMockMqttConn *conn, gconstpointer data, gsize size,
+                   GError **error)
+{
+  GOutputStream *out = g_io_stream_get_output_stream(conn->tls);
+
+  return g_output_stream_write_all(out, data, size, NULL, NULL, error);
+}
+
+/* sends the broker side, spaced the way it was captured */
+static gpointer
+fb_mock_mqtt_replay(gpointer user_data)
+{
+  FbMockMqttConn *conn = user_data;
+  gint64 start = g_get_monotonic_time();
+  guint i;
+
+  g_mutex_lock(&conn->lock);
+
+  for (i = 0; i < mqtt_frames->len && !conn->stop; i++)
+  {
+    FbMockFrame *frame = g_ptr_array_index(mqtt_frames, i);
+    gint64 due = start + fb_mock_scale(frame->time);
+
+    /* FALSE once due, the lock is free for PINGRESP meanwhile */
+    while (!conn->stop && g_cond_wait_until(&conn->cond, &conn->lock, due))
+      ;
+
+    if (conn->stop ||
+        !fb_mock_mqtt_write(conn, g_bytes_get_data(frame->data, NULL),
+                            g_bytes_get_size(frame->data), NULL))
+    {
+      break;
+    }
+  }
+
+  g_mutex_unlock(&conn->lock);
+
+  return NULL;
+}
+
+/* every connection gets a thread of its own, blocking I/O keeps it short */
+static gboolean
+fb_mock_mqtt_run(GThreadedSocketService *service,
+                 GSocketConnection *connection, GObject *source_object,
+                 gpointer user_data)
+{
+  GTlsCertificate *cert = user_data;
+  static const guint8 pingresp[] = { 0xd0, 0x00 };
+  FbMockMqttConn conn = { NULL };
+  GThread *replay = NULL;
+  GError *error = NULL;
+  guint type;
+
+  conn.tls = g_tls_server_connection_new(G_IO_STREAM(connection), cert,
+                                         &error);
+
+  if (!conn.tls ||
+      !g_tls_connection_handshake(G_TLS_CONNECTION(conn.tls), NULL, &error))
+  {
+    g_message("MQTT handshake failed: %s", error->message);
+    g_error_free(error);
+    g_clear_object(&conn.tls);
+    return TRUE;
+  }
+
+  g_mutex_init(&conn.lock);
+  g_cond_init(&conn.cond);
+
+  while (fb_mock_mqtt_read(g_io_stream_get_input_stream(conn.tls), &type,
+                           &error))
+  {
+    gboolean ok = TRUE;
+
+    if (type == FB_MOCK_MQTT_CONNECT && !replay)
+      replay = g_thread_new("mqtt-replay", fb_mock_mqtt_replay, &conn);
+    else if (type == FB_MOCK_MQTT_PINGREQ)
+    {
+      g_mutex_lock(&conn.lock);
+      ok = fb_mock_mqtt_write(&conn, pingresp, sizeof(pingresp), &error);
+      g_mutex_unlock(&conn.lock);
+    }
+    else if (type == FB_MOCK_MQTT_DISCONNECT)
+      break;
+
+    if (!ok)
+      break;
+  }
+
+  if (error)
+  {
+    g_message("MQTT connection closed: %s", error->message);
+    g_error_free(error);
+  }
+
+  if (replay)
+  {
+    g_mutex_lock(&conn.lock);
+    conn.stop = TRUE;
+    g_cond_signal(&conn.cond);
+    g_mutex_unlock(&conn.lock);
+    g_thread_join(replay);
+  }
+
+  g_io_stream_close(conn.tls, NULL, NULL);
+  g_object_unref(conn.tls);
+  g_cond_clear(&conn.cond);
+  g_mutex_clear(&conn.lock);
+
+  return TRUE;
+}
+
+static GSocketService *
+fb_mock_mqtt_new(GError **error)
+{
+  GTlsCertificate *cert;
+  GSocketService *service;
+  GInetAddress *loopback;
+  GSocketAddress *address;
+  gboolean listening;
+
+  cert = g_tls_certificate_new_from_files(cert_file, key_file, error);
+
+  if (!cert)
+    return NULL;
+
+  /* unlimited threads, load tests connect hundreds of accounts */
+  service = g_threaded_socket_service_new(-1);
+
+  /* loopback only, like the HTTP side */
+  loopback = g_inet_address_new_loopback(G_SOCKET_FAMILY_IPV4);
+  address = g_inet_socket_address_new(loopback, mqtt_port);
+  listening = g_socket_listener_add_address(G_SOCKET_LISTENER(service),
+                                            address, G_SOCKET_TYPE_STREAM,
+                                            G_SOCKET_PROTOCOL_TCP, NULL,
+                                            NULL, error);
+  g_object_unref(address);
+  g_object_unref(loopback);
+
+  if (!listening)
+  {
+    g_object_unref(service);
+    g_object_unref(cert);
+    return NULL;
+  }
+
+  g_signal_connect_data(service, "run", G_CALLBACK(fb_mock_mqtt_run), cert,
+                        (GClosureNotify)g_object_unref, 0);
+
+  return service;
+}
+
+int
+main(int argc, char **argv)
+{
+  GOptionContext *context;
+  GMainLoop *loop;
+  SoupServer *server;
+  GSocketService *mqtt = NULL;
+  GError *error = NULL;
+
+  context = g_option_context_new("- Facebook API stand-in");
+  g_option_context_add_main_entries(context, entries, NULL);
+
+  if (!g_option_context_parse(context, &argc, &argv, &error))
+  {
+    g_printerr("%s\n", error->message);
+    return 1;
+  }
+
+  g_option_context_free(context);
+
+  if (!data_dir == !replay_file)
+  {
+    g_printerr("either --data or --replay is required\n");
+    return 1;
+  }
+
+  mqtt_frames = g_ptr_array_new_with_free_func(fb_mock_frame_free);
+
+  if (replay_file)
+  {
+    if (!fb_mock_replay_load(&error))
+    {
+      g_printerr("%s\n", error->message);
+      return 1;
+    }
+  }
+  else
+    fb_mock_data_load();
+
+  server = soup_server_new(SOUP_SERVER_SERVER_HEADER, "fb-mock-server ",
+                           NULL);
+  soup_server_add_handler(server, NULL, fb_mock_http_cb, NULL, NULL);
+
+  if (!soup_server_listen_local(server, http_port, 0, &error))
+  {
+    g_printerr("HTTP: %s\n", error->message);
+    return 1;
+  }
+
+  if (cert_file && key_file)
+  {
+    if (!(mqtt = fb_mock_mqtt_new(&error)))
+    {
+      g_printerr("MQTT: %s\n", error->message);
+      return 1;
+    }
+  }
+  else
+    g_message("no --cert and --key, MQTT is disabled");
+
+  loop = g_main_loop_new(NULL, FALSE);
+  g_main_loop_run(loop);
+
+  g_main_loop_unref(loop);
+  g_clear_object(&mqtt);
+  g_object_unref(server);
+  g_clear_pointer(&replay_http, g_hash_table_destroy);
+  g_ptr_array_unref(mqtt_frames);
+
+  return 0;
+}
@@ -0,0 +1,16 @@
+TEMPLATE = app
+CONFIG -= console
+CONFIG -= app_bundle
+CONFIG -= qt
+
+CONFIG += link_pkgconfig
+
+PKGCONFIG += gio-2.0 json-glib-1.0 libsoup-2.4
+
+INCLUDEPATH += ../../bitlbee-compat
+
+SOURCES += \
+    ../../bitlbee-compat/fb-capture.c \
+    fb-mock-server.c
+
+QMAKE_CFLAGS += -Wno-unused-parameter
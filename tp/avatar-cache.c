@@ -0,0 +1,607 @@
+/*
+ * This file is part of telepathy-facebook
+ *
+ * Copyright (C) 2025 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define FB_DEBUG_FLAG FB_DEBUG_AVATAR
+
+#include <string.h>
+
+#include <glib/gstdio.h>
+
+#include "avatar-cache.h"
+#include "debug.h"
+
+#define FB_AVATAR_CACHE_DIR "telepathy-facebook"
+#define FB_AVATAR_CACHE_SUBDIR "avatars"
+
+/* size budget of the cache, in bytes */
+#define FB_AVATAR_CACHE_BUDGET (16 * 1024 * 1024)
+
+/* entries with validators get revalidated once older than this, in seconds */
+#define FB_AVATAR_CACHE_MAX_AGE (7 * 24 * 60 * 60)
+
+/* the HTTP validators of an entry are kept next to it, tokens never contain
+ * a dot so the names can't clash */
+#define FB_AVATAR_CACHE_VALIDATORS_SUFFIX ".validators"
+#define FB_AVATAR_CACHE_VALIDATORS_TYPE "(msmsx)"
+
+struct _FbAvatarCacheEntry
+{
+  /* entries are linked in the LRU queue, most recently used first */
+  GList link;
+  gchar *name;
+  goffset size;
+  gint64 mtime;
+  /* whether there is a sidecar file, known from the scan */
+  gboolean has_validators;
+  /* loaded from the sidecar file on first use */
+  gboolean validators_loaded;
+  gchar *etag;
+  gchar *last_modified;
+  /* real time the entry was last known to be current, in seconds */
+  gint64 validated;
+  /* the image while it is waiting to be written */
+  GBytes *pending;
+};
+
+typedef struct _FbAvatarCacheEntry FbAvatarCacheEntry;
+
+struct _FbAvatarCache
+{
+  gchar *path;
+  /* file name -> FbAvatarCacheEntry */
+  GHashTable *entries;
+  GQueue lru;
+  goffset size;
+  goffset budget;
+  /* a single thread, so operations on the same file happen in order */
+  GThreadPool *writer;
+};
+
+typedef enum
+{
+  FB_AVATAR_CACHE_WRITE,
+  FB_AVATAR_CACHE_TOUCH,
+  FB_AVATAR_CACHE_UNLINK
+} FbAvatarCacheOp;
+
+struct _FbAvatarCacheJob
+{
+  FbAvatarCacheOp op;
+  FbAvatarCache *cache;
+  gchar *path;
+  GBytes *data;
+  /* set for images, the entry gets told once they are written */
+  gchar *name;
+  GError *error;
+};
+
+typedef struct _FbAvatarCacheJob FbAvatarCacheJob;
+
+static void
+fb_avatar_cache_entry_free(gpointer data)
+{
+  FbAvatarCacheEntry *entry = data;
+
+  g_free(entry->name);
+  g_free(entry->etag);
+  g_free(entry->last_modified);
+
+  if (entry->pending)
+    g_bytes_unref(entry->pending);
+
+  g_slice_free(FbAvatarCacheEntry, entry);
+}
+
+static void
+fb_avatar_cache_job_free(FbAvatarCacheJob *job)
+{
+  g_free(job->path);
+  g_free(job->name);
+
+  if (job->data)
+    g_bytes_unref(job->data);
+
+  g_clear_error(&job->error);
+  g_slice_free(FbAvatarCacheJob, job);
+}
+
+static void
+fb_avatar_cache_unlink_entry(FbAvatarCache *cache, FbAvatarCacheEntry *entry);
+
+/* main loop side of an image write */
+static gboolean
+fb_avatar_cache_written(gpointer data)
+{
+  FbAvatarCacheJob *job = data;
+  FbAvatarCache *cache = job->cache;
+  FbAvatarCacheEntry *entry = g_hash_table_lookup(cache->entries, job->name);
+
+  /* unless it was evicted or stored again in the meantime */
+  if (entry && entry->pending == job->data)
+  {
+    g_bytes_unref(entry->pending);
+    entry->pending = NULL;
+
+    if (job->error)
+    {
+      FB_DEBUG("failed to cache avatar %s: %s", job->name,
+               job->error->message);
+      fb_avatar_cache_unlink_entry(cache, entry);
+    }
+  }
+
+  fb_avatar_cache_job_free(job);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+fb_avatar_cache_job_run(gpointer data, gpointer user_data)
+{
+  FbAvatarCacheJob *job = data;
+
+  switch (job->op)
+  {
+    case FB_AVATAR_CACHE_WRITE:
+    {
+      gsize size;
+      gconstpointer contents = g_bytes_get_data(job->data, &size);
+
+      g_file_set_contents(job->path, contents, size, &job->error);
+      break;
+    }
+    case FB_AVATAR_CACHE_TOUCH:
+      g_utime(job->path, NULL);
+      break;
+    case FB_AVATAR_CACHE_UNLINK:
+      g_unlink(job->path);
+      break;
+  }
+
+  if (job->name)
+    g_idle_add(fb_avatar_cache_written, job);
+  else
+    fb_avatar_cache_job_free(job);
+}
+
+/* takes @path */
+static void
+fb_avatar_cache_queue(FbAvatarCache *cache, FbAvatarCacheOp op, gchar *path,
+                      GBytes *data, const gchar *name)
+{
+  FbAvatarCacheJob *job = g_slice_new0(FbAvatarCacheJob);
+
+  job->op = op;
+  job->cache = cache;
+  job->path = path;
+  job->data = data ? g_bytes_ref(data) : NULL;
+  job->name = g_strdup(name);
+
+  g_thread_pool_push(cache->writer, job, NULL);
+}
+
+/* tokens are numbers or checksums, but don't trust them as file names */
+static gchar *
+token_to_name(const gchar *token)
+{
+  for (const gchar *p = token; *p; p++)
+  {
+    if (!g_ascii_isalnum(*p) && *p != '_' && *p != '-')
+      return g_compute_checksum_for_string(G_CHECKSUM_SHA1, token, -1);
+  }
+
+  return g_strdup(token);
+}
+
+static gint
+entry_mtime_cmp(gconstpointer a, gconstpointer b)
+{
+  const FbAvatarCacheEntry *ea = *(FbAvatarCacheEntry **)a;
+  const FbAvatarCacheEntry *eb = *(FbAvatarCacheEntry **)b;
+
+  return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+static FbAvatarCacheEntry *
+fb_avatar_cache_add_entry(FbAvatarCache *cache, const gchar *name,
+                          goffset size, gint64 mtime)
+{
+  FbAvatarCacheEntry *entry = g_slice_new0(FbAvatarCacheEntry);
+
+  entry->link.data = entry;
+  entry->name = g_strdup(name);
+  entry->size = size;
+  entry->mtime = mtime;
+
+  g_hash_table_insert(cache->entries, entry->name, entry);
+  cache->size += size;
+
+  return entry;
+}
+
+static void
+fb_avatar_cache_remove_entry(FbAvatarCache *cache, FbAvatarCacheEntry *entry)
+{
+  g_queue_unlink(&cache->lru, &entry->link);
+  cache->size -= entry->size;
+  g_hash_table_remove(cache->entries, entry->name);
+}
+
+static gchar *
+fb_avatar_cache_validators_path(FbAvatarCache *cache, const gchar *name)
+{
+  gchar *file = g_strconcat(name, FB_AVATAR_CACHE_VALIDATORS_SUFFIX, NULL);
+  gchar *path = g_build_filename(cache->path, file, NULL);
+
+  g_free(file);
+
+  return path;
+}
+
+static void
+fb_avatar_cache_load_validators(FbAvatarCache *cache,
+                                FbAvatarCacheEntry *entry)
+{
+  gchar *path;
+  gchar *contents;
+  gsize length;
+
+  if (entry->validators_loaded)
+    return;
+
+  entry->validators_loaded = TRUE;
+  path = fb_avatar_cache_validators_path(cache, entry->name);
+
+  if (g_file_get_contents(path, &contents, &length, NULL))
+  {
+    GVariant *v = g_variant_new_from_data(
+      G_VARIANT_TYPE(FB_AVATAR_CACHE_VALIDATORS_TYPE), contents, length,
+      FALSE, g_free, contents);
+
+    g_variant_ref_sink(v);
+    g_variant_get(v, FB_AVATAR_CACHE_VALIDATORS_TYPE, &entry->etag,
+                  &entry->last_modified, &entry->validated);
+    g_variant_unref(v);
+  }
+
+  g_free(path);
+}
+
+static void
+fb_avatar_cache_save_validators(FbAvatarCache *cache,
+                                FbAvatarCacheEntry *entry)
+{
+  gchar *path = fb_avatar_cache_validators_path(cache, entry->name);
+
+  if (entry->etag || entry->last_modified)
+  {
+    GVariant *v = g_variant_ref_sink(
+      g_variant_new(FB_AVATAR_CACHE_VALIDATORS_TYPE, entry->etag,
+                    entry->last_modified, entry->validated));
+    GBytes *bytes = g_variant_get_data_as_bytes(v);
+
+    fb_avatar_cache_queue(cache, FB_AVATAR_CACHE_WRITE, path, bytes, NULL);
+    g_bytes_unref(bytes);
+    g_variant_unref(v);
+  }
+  else
+    fb_avatar_cache_queue(cache, FB_AVATAR_CACHE_UNLINK, path, NULL, NULL);
+}
+
+static void
+fb_avatar_cache_unlink_entry(FbAvatarCache *cache, FbAvatarCacheEntry *entry)
+{
+  fb_avatar_cache_queue(cache, FB_AVATAR_CACHE_UNLINK,
+                        g_build_filename(cache->path, entry->name, NULL),
+                        NULL, NULL);
+  fb_avatar_cache_queue(cache, FB_AVATAR_CACHE_UNLINK,
+                        fb_avatar_cache_validators_path(cache, entry->name),
+                        NULL, NULL);
+  fb_avatar_cache_remove_entry(cache, entry);
+}
+
+static FbAvatarCacheEntry *
+fb_avatar_cache_find(FbAvatarCache *cache, const gchar *token)
+{
+  gchar *name;
+  FbAvatarCacheEntry *entry;
+
+  if (!token)
+    return NULL;
+
+  name = token_to_name(token);
+  entry = g_hash_table_lookup(cache->entries, name);
+  g_free(name);
+
+  return entry;
+}
+
+/* rebuild the LRU order from the file modification times */
+static void
+fb_avatar_cache_scan(FbAvatarCache *cache)
+{
+  GDir *dir = g_dir_open(cache->path, 0, NULL);
+  GPtrArray *found;
+  /* entry name -> mtime of its validators */
+  GHashTable *validated;
+  const gchar *name;
+
+  if (!dir)
+    return;
+
+  found = g_ptr_array_new();
+  validated = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+  while ((name = g_dir_read_name(dir)))
+  {
+    gchar *path;
+    GStatBuf st;
+
+    path = g_build_filename(cache->path, name, NULL);
+
+    if (g_stat(path, &st) || !S_ISREG(st.st_mode))
+    {
+      g_free(path);
+      continue;
+    }
+
+    /* a sidecar is rewritten whenever its entry is validated, so its
+     * mtime tells the age without reading it */
+    if (g_str_has_suffix(name, FB_AVATAR_CACHE_VALIDATORS_SUFFIX))
+    {
+      gint64 *mtime = g_new(gint64, 1);
+
+      *mtime = st.st_mtime;
+      g_hash_table_insert(
+        validated,
+        g_strndup(name,
+                  strlen(name) - strlen(FB_AVATAR_CACHE_VALIDATORS_SUFFIX)),
+        mtime);
+    }
+    else
+    {
+      g_ptr_array_add(found, fb_avatar_cache_add_entry(
+                        cache, name, st.st_size, st.st_mtime));
+    }
+
+    g_free(path);
+  }
+
+  g_dir_close(dir);
+  g_ptr_array_sort(found, entry_mtime_cmp);
+
+  for (guint i = 0; i < found->len; i++)
+  {
+    FbAvatarCacheEntry *entry = g_ptr_array_index(found, i);
+    gint64 *mtime = g_hash_table_lookup(validated, entry->name);
+
+    if (mtime)
+    {
+      entry->has_validators = TRUE;
+      entry->validated = *mtime;
+    }
+
+    g_queue_push_head_link(&cache->lru, &entry->link);
+  }
+
+  g_hash_table_unref(validated);
+
+  FB_DEBUG("%u avatars, %" G_GOFFSET_FORMAT " bytes in cache",
+           found->len, cache->size);
+
+  g_ptr_array_free(found, TRUE);
+}
+
+static void
+fb_avatar_cache_evict(FbAvatarCache *cache)
+{
+  while (cache->size > cache->budget && cache->lru.tail)
+  {
+    FbAvatarCacheEntry *entry = cache->lru.tail->data;
+
+    FB_DEBUG("evicting %s", entry->name);
+
+    fb_avatar_cache_unlink_entry(cache, entry);
+  }
+}
+
+FbAvatarCache *
+fb_avatar_cache_get_default(void)
+{
+  static FbAvatarCache *cache = NULL;
+
+  if (G_UNLIKELY(!cache))
+  {
+    cache = g_new0(FbAvatarCache, 1);
+    cache->path = g_build_filename(g_get_user_cache_dir(),
+                                   FB_AVATAR_CACHE_DIR,
+                                   FB_AVATAR_CACHE_SUBDIR,
+                                   NULL);
+    cache->entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                           fb_avatar_cache_entry_free);
+    g_queue_init(&cache->lru);
+    cache->budget = FB_AVATAR_CACHE_BUDGET;
+    cache->writer = g_thread_pool_new(fb_avatar_cache_job_run, NULL, 1,
+                                      FALSE, NULL);
+
+    g_mkdir_with_parents(cache->path, 0700);
+    fb_avatar_cache_scan(cache);
+    fb_avatar_cache_evict(cache);
+  }
+
+  return cache;
+}
+
+goffset
+fb_avatar_cache_get_budget(FbAvatarCache *cache)
+{
+  g_return_val_if_fail(cache != NULL, 0);
+
+  return cache->budget;
+}
+
+GBytes *
+fb_avatar_cache_lookup(FbAvatarCache *cache, const gchar *token)
+{
+  gchar *path;
+  gchar *contents;
+  gsize length;
+  FbAvatarCacheEntry *entry;
+  GBytes *data;
+
+  g_return_val_if_fail(cache != NULL, NULL);
+
+  if (!(entry = fb_avatar_cache_find(cache, token)))
+    return NULL;
+
+  path = g_build_filename(cache->path, entry->name, NULL);
+
+  if (entry->pending)
+    data = g_bytes_ref(entry->pending);
+  else if (g_file_get_contents(path, &contents, &length, NULL))
+    data = g_bytes_new_take(contents, length);
+  else
+  {
+    /* removed behind our back */
+    g_free(path);
+    fb_avatar_cache_unlink_entry(cache, entry);
+    return NULL;
+  }
+
+  /* keep the on-disk LRU order in sync for the next scan */
+  entry->mtime = g_get_real_time() / G_USEC_PER_SEC;
+  fb_avatar_cache_queue(cache, FB_AVATAR_CACHE_TOUCH, path, NULL, NULL);
+
+  g_queue_unlink(&cache->lru, &entry->link);
+  g_queue_push_head_link(&cache->lru, &entry->link);
+
+  return data;
+}
+
+gboolean
+fb_avatar_cache_is_fresh(FbAvatarCache *cache, const gchar *token)
+{
+  FbAvatarCacheEntry *entry;
+
+  g_return_val_if_fail(cache != NULL, FALSE);
+
+  if (!(entry = fb_avatar_cache_find(cache, token)))
+    return FALSE;
+
+  /* called for the whole roster, so this must not read the sidecar, the
+   * scan knows whether there is one and how old it is */
+  if (entry->validators_loaded)
+    entry->has_validators = entry->etag || entry->last_modified;
+
+  /* without validators the only check we have is the token itself */
+  if (!entry->has_validators)
+    return TRUE;
+
+  return g_get_real_time() / G_USEC_PER_SEC - entry->validated <
+      FB_AVATAR_CACHE_MAX_AGE;
+}
+
+gboolean
+fb_avatar_cache_get_validators(FbAvatarCache *cache, const gchar *token,
+                               const gchar **etag,
+                               const gchar **last_modified)
+{
+  FbAvatarCacheEntry *entry;
+
+  g_return_val_if_fail(cache != NULL, FALSE);
+
+  *etag = *last_modified = NULL;
+
+  if (!(entry = fb_avatar_cache_find(cache, token)))
+    return FALSE;
+
+  fb_avatar_cache_load_validators(cache, entry);
+  *etag = entry->etag;
+  *last_modified = entry->last_modified;
+
+  return entry->etag || entry->last_modified;
+}
+
+void
+fb_avatar_cache_revalidated(FbAvatarCache *cache, const gchar *token,
+                            const gchar *etag, const gchar *last_modified)
+{
+  FbAvatarCacheEntry *entry;
+
+  g_return_if_fail(cache != NULL);
+
+  if (!(entry = fb_avatar_cache_find(cache, token)))
+    return;
+
+  fb_avatar_cache_load_validators(cache, entry);
+
+  /* a 304 may come with updated validators */
+  if (etag)
+  {
+    g_free(entry->etag);
+    entry->etag = g_strdup(etag);
+  }
+
+  if (last_modified)
+  {
+    g_free(entry->last_modified);
+    entry->last_modified = g_strdup(last_modified);
+  }
+
+  entry->validated = g_get_real_time() / G_USEC_PER_SEC;
+  fb_avatar_cache_save_validators(cache, entry);
+}
+
+void
+fb_avatar_cache_store(FbAvatarCache *cache, const gchar *token,
+                      GBytes *data, const gchar *etag,
+                      const gchar *last_modified)
+{
+  gchar *name;
+  FbAvatarCacheEntry *entry;
+
+  g_return_if_fail(cache != NULL);
+  g_return_if_fail(token != NULL);
+  g_return_if_fail(data != NULL);
+
+  name = token_to_name(token);
+
+  if ((entry = g_hash_table_lookup(cache->entries, name)))
+    fb_avatar_cache_remove_entry(cache, entry);
+
+  entry = fb_avatar_cache_add_entry(cache, name, g_bytes_get_size(data),
+                                    g_get_real_time() / G_USEC_PER_SEC);
+  entry->pending = g_bytes_ref(data);
+  entry->validators_loaded = TRUE;
+  entry->etag = g_strdup(etag);
+  entry->last_modified = g_strdup(last_modified);
+  entry->validated = entry->mtime;
+
+  /* written behind, lookups get the image from memory until then */
+  fb_avatar_cache_queue(cache, FB_AVATAR_CACHE_WRITE,
+                        g_build_filename(cache->path, name, NULL), data,
+                        name);
+  fb_avatar_cache_save_validators(cache, entry);
+  g_queue_push_head_link(&cache->lru, &entry->link);
+  fb_avatar_cache_evict(cache);
+
+  g_free(name);
+}
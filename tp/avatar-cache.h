@@ -0,0 +1,125 @@
+/*
+ * This file is part of telepathy-facebook
+ *
+ * Copyright (C) 2025 Ivaylo Dimitrov <ivo.g.dimitrov.75@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library. If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef __FB_AVATAR_CACHE_H__
+#define __FB_AVATAR_CACHE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * @file avatar-cache.h
+ * @brief On-disk avatar cache.
+ *
+ * Avatars are stored under the user cache directory, one file per avatar
+ * token. As a token identifies the image version, entries never go stale
+ * and the cache is shared by all accounts. Once the cache grows over its
+ * size budget the least recently used entries are evicted.
+ *
+ * The HTTP validators an image came with are kept as well, so old entries
+ * can be revalidated with a conditional GET instead of downloaded again.
+ *
+ * Writes and evictions go to disk on a worker thread, an image waiting to
+ * be written is served from memory.
+ */
+
+typedef struct _FbAvatarCache FbAvatarCache;
+
+/**
+ * fb_avatar_cache_get_default:
+ *
+ * @returns (transfer none): the process-wide avatar cache
+ */
+FbAvatarCache *
+fb_avatar_cache_get_default(void);
+
+/**
+ * fb_avatar_cache_get_budget:
+ * @cache: the cache
+ *
+ * @returns: how many bytes the cache holds before it starts evicting
+ */
+goffset
+fb_avatar_cache_get_budget(FbAvatarCache *cache);
+
+/**
+ * fb_avatar_cache_lookup:
+ * @cache: the cache
+ * @token: avatar token
+ *
+ * @returns (transfer full) (nullable): the cached image, or NULL on a miss.
+ */
+GBytes *
+fb_avatar_cache_lookup(FbAvatarCache *cache, const gchar *token);
+
+/**
+ * fb_avatar_cache_is_fresh:
+ * @cache: the cache
+ * @token: avatar token
+ *
+ * @returns: TRUE if @token is cached and doesn't need revalidation
+ */
+gboolean
+fb_avatar_cache_is_fresh(FbAvatarCache *cache, const gchar *token);
+
+/**
+ * fb_avatar_cache_get_validators:
+ * @cache: the cache
+ * @token: avatar token
+ * @etag: (out) (transfer none): return location for the ETag
+ * @last_modified: (out) (transfer none): return location for the
+ *   Last-Modified date
+ *
+ * @returns: TRUE if @token is cached with at least one validator
+ */
+gboolean
+fb_avatar_cache_get_validators(FbAvatarCache *cache, const gchar *token,
+                               const gchar **etag,
+                               const gchar **last_modified);
+
+/**
+ * fb_avatar_cache_revalidated:
+ * @cache: the cache
+ * @token: avatar token
+ * @etag: (nullable): ETag sent with the 304, if any
+ * @last_modified: (nullable): Last-Modified sent with the 304, if any
+ *
+ * Marks the entry for @token as current again.
+ */
+void
+fb_avatar_cache_revalidated(FbAvatarCache *cache, const gchar *token,
+                            const gchar *etag, const gchar *last_modified);
+
+/**
+ * fb_avatar_cache_store:
+ * @cache: the cache
+ * @token: avatar token
+ * @data: the image
+ * @etag: (nullable): ETag the image came with
+ * @last_modified: (nullable): Last-Modified date the image came with
+ *
+ * Stores @data under @token, evicting old entries if needed.
+ */
+void
+fb_avatar_cache_store(FbAvatarCache *cache, const gchar *token,
+                      GBytes *data, const gchar *etag,
+                      const gchar *last_modified);
+
+G_END_DECLS
+
+#endif /* __FB_AVATAR_CACHE_H__ */
@@ -21,75 +21,415 @@
 
 #define FB_DEBUG_FLAG FB_DEBUG_AVATAR
 
+#include "avatar-cache.h"
 #include "avatars.h"
 #include "connection.h"
 #include "contact-list.h"
 #include "debug.h"
-
-struct avatar_request_queue
+#include "fb-http-ext.h"
+
+/* background prefetch budget, on demand requests always go first */
+#define FB_AVATAR_PREFETCH_MAX_REQUESTS 1
+#define FB_AVATAR_PREFETCH_BYTES_PER_SEC (16 * 1024)
+/* how long to wait before looking again while paused, in seconds */
+#define FB_AVATAR_PREFETCH_RETRY_INTERVAL 5
+/* share of the cache budget a connection may fill with prefetches, the
+ * cache is shared by all accounts and on demand fetches need room too */
+#define FB_AVATAR_PREFETCH_BUDGET_SHARE 2
+
+struct _FbAvatarFetcher
 {
-  FbHttp *http;
-  GQueue *queue;
+  /* NULL once the fetcher is freed while requests are still in flight */
   FbConnection *conn;
+  /* shared by all requests, so connections to the CDN get reused */
+  FbHttp *http;
+  /* handles waiting for a free slot */
+  GQueue pending;
+  /* handle -> whether a client asked for it, for handles that are either
+   * pending or being fetched */
+  GHashTable *handles;
+  guint active;
+  guint max_active;
+  /* handles to warm the cache with, most wanted first */
+  GQueue prefetch;
+  guint prefetch_active;
+  guint prefetch_id;
+  /* monotonic time the byte budget allows the next prefetch at */
+  gint64 prefetch_next;
+  /* bytes prefetched over the connection's lifetime, not reset when the
+   * queue is rebuilt, or the tail would keep evicting the head */
+  goffset prefetch_bytes;
 };
 
-static gboolean
-idle_send_req(gpointer user_data)
+struct _FbAvatarFetch
 {
-  fb_http_request_send(user_data);
+  FbAvatarFetcher *fetcher;
+  TpHandle handle;
+  gchar *token;
+  gboolean prefetch;
+};
 
-  return G_SOURCE_REMOVE;
+typedef struct _FbAvatarFetch FbAvatarFetch;
+
+static void
+fb_avatar_fetcher_pump(FbAvatarFetcher *fetcher);
+
+static void
+fb_avatar_fetcher_prefetch_schedule(FbAvatarFetcher *fetcher, guint delay);
+
+static void
+fb_avatar_fetcher_destroy(FbAvatarFetcher *fetcher)
+{
+  g_queue_clear(&fetcher->pending);
+  g_queue_clear(&fetcher->prefetch);
+  g_hash_table_destroy(fetcher->handles);
+  g_object_unref(fetcher->http);
+  g_slice_free(FbAvatarFetcher, fetcher);
+}
+
+/* takes @avatar */
+static void
+fb_connection_avatars_emit_retrieved(FbConnection *conn, TpHandle handle,
+                                     const gchar *token, GBytes *avatar)
+{
+  /* no copy as long as we hold the only reference, and a GByteArray is a
+   * GArray of bytes underneath */
+  GByteArray *data = g_bytes_unref_to_array(avatar);
+
+  tp_svc_connection_interface_avatars_emit_avatar_retrieved(
+    conn, handle, token, (GArray *)data, "image/jpeg");
+  g_byte_array_unref(data);
 }
 
 static void
 avatar_cb(FbHttpRequest *req, gpointer user_data)
 {
-  struct avatar_request_queue *arq = (struct avatar_request_queue *)user_data;
-  FbContact *c = g_queue_pop_tail(arq->queue);
-  gboolean connected =
-    tp_base_connection_get_status(
-      TP_BASE_CONNECTION(arq->conn)) == TP_CONNECTION_STATUS_CONNECTED;
+  FbAvatarFetch *fetch = user_data;
+  FbAvatarFetcher *fetcher = fetch->fetcher;
+  FbAvatarCache *cache = fb_avatar_cache_get_default();
+  GBytes *icon = NULL;
+  gboolean requested;
+  gsize icon_size = 0;
+  gint code;
+
+  requested = GPOINTER_TO_INT(
+    g_hash_table_lookup(fetcher->handles, GUINT_TO_POINTER(fetch->handle)));
+  fetcher->active--;
+  g_hash_table_remove(fetcher->handles, GUINT_TO_POINTER(fetch->handle));
+  fb_http_request_get_status(req, &code);
+
+  if (fb_http_request_not_modified(req))
+  {
+    FB_DEBUG("avatar %s not modified", fetch->token);
+
+    fb_avatar_cache_revalidated(cache, fetch->token,
+                                fb_http_request_get_etag(req),
+                                fb_http_request_get_last_modified(req));
+    icon = fb_avatar_cache_lookup(cache, fetch->token);
 
-  if (connected)
+    /* evicted while we were asking, the next try won't be conditional */
+    if (!icon && requested && fetcher->conn)
+      fb_avatar_fetcher_fetch(fetcher, fetch->handle);
+  }
+  else if (code == 200)
   {
-    gint code;
+    icon = fb_http_request_take_bytes(req);
+
+    if (icon && !(icon_size = g_bytes_get_size(icon)))
+      g_clear_pointer(&icon, g_bytes_unref);
 
-    fb_http_request_get_status(req, &code);
+    if (icon && fetch->token)
+    {
+      fb_avatar_cache_store(cache, fetch->token, icon,
+                            fb_http_request_get_etag(req),
+                            fb_http_request_get_last_modified(req));
+    }
+  }
 
-    if (code == 200)
+  if (icon && requested && fetcher->conn &&
+      tp_base_connection_get_status(TP_BASE_CONNECTION(fetcher->conn)) ==
+      TP_CONNECTION_STATUS_CONNECTED)
+  {
+    FbContactList *contact_list =
+      fb_connection_get_contact_list(fetcher->conn);
+    FbContact *c = fb_contact_list_get_user(contact_list, fetch->handle);
+
+    /* the avatar might have changed while we were fetching it, prefetched
+     * ones only get announced if a client asked for them meanwhile */
+    if (c && !g_strcmp0(c->avatar_token, fetch->token))
     {
-      gsize icon_size;
-      const gchar *icon_data = fb_http_request_get_data(req, &icon_size);
-      FbContactList *contact_list = fb_connection_get_contact_list(arq->conn);
-
-      if (icon_data)
-      {
-        GArray *avatar = g_array_sized_new(FALSE, FALSE,
-                                           sizeof(gchar), icon_size);
-        TpHandle handle = fb_contact_list_ensure_handle(contact_list, c->uid);
-
-        g_array_append_vals(avatar, icon_data, icon_size);
-        tp_svc_connection_interface_avatars_emit_avatar_retrieved(
-          arq->conn, handle, c->avatar_token, avatar, "image/jpeg");
-        g_array_free(avatar, TRUE);
-      }
+      fb_connection_avatars_emit_retrieved(fetcher->conn, fetch->handle,
+                                           fetch->token,
+                                           g_steal_pointer(&icon));
     }
   }
 
-  if (g_queue_is_empty(arq->queue) || !connected)
+  if (icon)
+    g_bytes_unref(icon);
+
+  if (fetch->prefetch)
   {
-    g_object_unref(arq->http);
-    g_queue_free(arq->queue);
-    g_object_unref(arq->conn);
-    g_slice_free(struct avatar_request_queue, arq);
+    fetcher->prefetch_active--;
+    fetcher->prefetch_bytes += icon_size;
+    fetcher->prefetch_next = MAX(fetcher->prefetch_next,
+                                 g_get_monotonic_time()) +
+      icon_size * G_USEC_PER_SEC / FB_AVATAR_PREFETCH_BYTES_PER_SEC;
+  }
+
+  g_free(fetch->token);
+  g_slice_free(FbAvatarFetch, fetch);
+
+  if (fetcher->conn)
+  {
+    fb_avatar_fetcher_pump(fetcher);
+    fb_avatar_fetcher_prefetch_schedule(fetcher, 0);
+    return;
   }
-  else
+
+  if (!fetcher->active)
+    fb_avatar_fetcher_destroy(fetcher);
+}
+
+static void
+fb_avatar_fetcher_send(FbAvatarFetcher *fetcher, TpHandle handle,
+                       FbContact *c, gboolean prefetch)
+{
+  FbAvatarFetch *fetch = g_slice_new(FbAvatarFetch);
+  FbHttpRequest *req;
+  const gchar *etag;
+  const gchar *last_modified;
+
+  fetch->fetcher = fetcher;
+  fetch->handle = handle;
+  fetch->token = g_strdup(c->avatar_token);
+  fetch->prefetch = prefetch;
+
+  req = fb_http_request_new(fetcher->http, c->icon, FALSE, avatar_cb, fetch);
+  fb_http_request_set_priority(req, FB_HTTP_PRIORITY_BACKGROUND);
+  fb_http_request_set_cancellable(
+    req, fb_connection_get_cancellable(fetcher->conn));
+
+  /* only old entries get here, let the server tell if they are current */
+  if (fb_avatar_cache_get_validators(fb_avatar_cache_get_default(),
+                                     fetch->token, &etag, &last_modified))
   {
-    c = g_queue_peek_tail(arq->queue);
-    req = fb_http_request_new(arq->http, c->icon, FALSE,
-                              avatar_cb, arq);
-    g_idle_add_full(G_PRIORITY_LOW, idle_send_req, req, NULL);
+    fb_http_request_set_validators(req, etag, last_modified);
   }
+
+  fb_http_request_send(req);
+  fetcher->active++;
+}
+
+static void
+fb_avatar_fetcher_pump(FbAvatarFetcher *fetcher)
+{
+  FbContactList *contact_list = fb_connection_get_contact_list(fetcher->conn);
+
+  while (fetcher->active < fetcher->max_active &&
+         !g_queue_is_empty(&fetcher->pending))
+  {
+    TpHandle handle = GPOINTER_TO_UINT(g_queue_pop_head(&fetcher->pending));
+    FbContact *c = fb_contact_list_get_user(contact_list, handle);
+
+    if (!c || !c->icon)
+    {
+      g_hash_table_remove(fetcher->handles, GUINT_TO_POINTER(handle));
+      continue;
+    }
+
+    fb_avatar_fetcher_send(fetcher, handle, c, FALSE);
+  }
+}
+
+static gboolean
+fb_avatar_fetcher_prefetch_cb(gpointer user_data)
+{
+  FbAvatarFetcher *fetcher = user_data;
+  TpBaseConnection *base = TP_BASE_CONNECTION(fetcher->conn);
+  FbContactList *contact_list = fb_connection_get_contact_list(fetcher->conn);
+  FbAvatarCache *cache = fb_avatar_cache_get_default();
+  gint64 now = g_get_monotonic_time();
+
+  fetcher->prefetch_id = 0;
+
+  if (fetcher->prefetch_active >= FB_AVATAR_PREFETCH_MAX_REQUESTS)
+    return G_SOURCE_REMOVE;
+
+  /* more would only push out what we prefetched first */
+  if (fetcher->prefetch_bytes >=
+      fb_avatar_cache_get_budget(cache) / FB_AVATAR_PREFETCH_BUDGET_SHARE)
+  {
+    FB_DEBUG("prefetch budget used up, %u avatars left",
+             g_queue_get_length(&fetcher->prefetch));
+    g_queue_clear(&fetcher->prefetch);
+    return G_SOURCE_REMOVE;
+  }
+
+  /* stay out of the way while clients wait for avatars, and while this or
+   * another connection has requests somebody is waiting for */
+  if (tp_base_connection_get_status(base) != TP_CONNECTION_STATUS_CONNECTED ||
+      fetcher->active > fetcher->prefetch_active ||
+      fb_http_get_backlog(FB_HTTP_PRIORITY_INTERACTIVE))
+  {
+    fb_avatar_fetcher_prefetch_schedule(
+      fetcher, FB_AVATAR_PREFETCH_RETRY_INTERVAL * 1000);
+    return G_SOURCE_REMOVE;
+  }
+
+  if (now < fetcher->prefetch_next)
+  {
+    fb_avatar_fetcher_prefetch_schedule(
+      fetcher, (fetcher->prefetch_next - now) / 1000 + 1);
+    return G_SOURCE_REMOVE;
+  }
+
+  while (!g_queue_is_empty(&fetcher->prefetch))
+  {
+    TpHandle handle = GPOINTER_TO_UINT(g_queue_pop_head(&fetcher->prefetch));
+    FbContact *c = fb_contact_list_get_user(contact_list, handle);
+
+    if (!c || !c->icon || !c->avatar_token ||
+        g_hash_table_contains(fetcher->handles, GUINT_TO_POINTER(handle)) ||
+        fb_avatar_cache_is_fresh(cache, c->avatar_token))
+    {
+      continue;
+    }
+
+    FB_DEBUG("prefetching avatar %s", c->avatar_token);
+
+    g_hash_table_insert(fetcher->handles, GUINT_TO_POINTER(handle),
+                        GINT_TO_POINTER(FALSE));
+    fb_avatar_fetcher_send(fetcher, handle, c, TRUE);
+    fetcher->prefetch_active++;
+    break;
+  }
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+fb_avatar_fetcher_prefetch_schedule(FbAvatarFetcher *fetcher, guint delay)
+{
+  if (fetcher->prefetch_id || g_queue_is_empty(&fetcher->prefetch))
+    return;
+
+  fetcher->prefetch_id = g_timeout_add_full(G_PRIORITY_LOW, delay,
+                                            fb_avatar_fetcher_prefetch_cb,
+                                            fetcher, NULL);
+}
+
+/* online contacts first, then the ones seen most recently */
+static gint
+prefetch_cmp(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  FbContactList *contact_list = user_data;
+  FbContact *ca = fb_contact_list_get_user(contact_list, GPOINTER_TO_UINT(a));
+  FbContact *cb = fb_contact_list_get_user(contact_list, GPOINTER_TO_UINT(b));
+
+  if (ca->active != cb->active)
+    return ca->active ? -1 : 1;
+
+  if (ca->last_seen != cb->last_seen)
+    return ca->last_seen > cb->last_seen ? -1 : 1;
+
+  return 0;
+}
+
+FbAvatarFetcher *
+fb_avatar_fetcher_new(FbConnection *conn, guint max_requests)
+{
+  FbAvatarFetcher *fetcher = g_slice_new0(FbAvatarFetcher);
+
+  fetcher->conn = conn;
+  fetcher->http = fb_http_new(FB_API_AGENT);
+  g_queue_init(&fetcher->pending);
+  g_queue_init(&fetcher->prefetch);
+  fetcher->handles = g_hash_table_new(g_direct_hash, g_direct_equal);
+  fetcher->max_active = MAX(max_requests, 1);
+
+  return fetcher;
+}
+
+void
+fb_avatar_fetcher_fetch(FbAvatarFetcher *fetcher, TpHandle handle)
+{
+  gpointer requested;
+
+  g_return_if_fail(fetcher != NULL);
+
+  /* already waiting, overlapping RequestAvatars calls share the result */
+  if (g_hash_table_lookup_extended(fetcher->handles, GUINT_TO_POINTER(handle),
+                                   NULL, &requested))
+  {
+    /* a prefetch is on its way, have it announced when it lands */
+    if (!GPOINTER_TO_INT(requested))
+    {
+      g_hash_table_insert(fetcher->handles, GUINT_TO_POINTER(handle),
+                          GINT_TO_POINTER(TRUE));
+    }
+
+    return;
+  }
+
+  g_hash_table_insert(fetcher->handles, GUINT_TO_POINTER(handle),
+                      GINT_TO_POINTER(TRUE));
+  g_queue_push_tail(&fetcher->pending, GUINT_TO_POINTER(handle));
+  fb_avatar_fetcher_pump(fetcher);
+}
+
+void
+fb_avatar_fetcher_prefetch(FbAvatarFetcher *fetcher)
+{
+  FbContactList *contact_list;
+  TpHandleSet *contacts;
+  TpIntsetFastIter iter;
+  TpHandle handle;
+
+  g_return_if_fail(fetcher != NULL);
+
+  contact_list = fb_connection_get_contact_list(fetcher->conn);
+
+  /* the list can't be asked for its contacts before it is received, the
+   * fetcher gets called again once it is */
+  if (tp_base_contact_list_get_state(TP_BASE_CONTACT_LIST(contact_list),
+                                     NULL) != TP_CONTACT_LIST_STATE_SUCCESS)
+  {
+    return;
+  }
+
+  contacts = tp_base_contact_list_dup_contacts(
+    TP_BASE_CONTACT_LIST(contact_list));
+
+  g_queue_clear(&fetcher->prefetch);
+  tp_intset_fast_iter_init(&iter, tp_handle_set_peek(contacts));
+
+  while (tp_intset_fast_iter_next(&iter, &handle))
+  {
+    if (fb_contact_list_get_user(contact_list, handle))
+      g_queue_push_tail(&fetcher->prefetch, GUINT_TO_POINTER(handle));
+  }
+
+  tp_handle_set_destroy(contacts);
+  g_queue_sort(&fetcher->prefetch, prefetch_cmp, contact_list);
+
+  FB_DEBUG("%u avatars to prefetch", g_queue_get_length(&fetcher->prefetch));
+
+  fb_avatar_fetcher_prefetch_schedule(fetcher, 0);
+}
+
+void
+fb_avatar_fetcher_free(FbAvatarFetcher *fetcher)
+{
+  g_return_if_fail(fetcher != NULL);
+
+  if (fetcher->prefetch_id)
+    g_source_remove(fetcher->prefetch_id);
+
+  /* in flight requests still point to us, the last one frees the fetcher */
+  fetcher->conn = NULL;
+
+  if (!fetcher->active)
+    fb_avatar_fetcher_destroy(fetcher);
 }
 
 static void
@@ -100,10 +440,11 @@ fb_connection_avatars_request_avatars(TpSvcConnectionInterfaceAvatars *self,
   FbConnection *conn = FB_CONNECTION(self);
   TpBaseConnection *base = TP_BASE_CONNECTION(conn);
   FbContactList *contact_list = fb_connection_get_contact_list(conn);
+  FbAvatarFetcher *fetcher = fb_connection_get_avatar_fetcher(conn);
   TpHandleRepoIface *contact_repo =
     tp_base_connection_get_handles(base, TP_HANDLE_TYPE_CONTACT);
+  FbAvatarCache *cache = fb_avatar_cache_get_default();
   GError *error = NULL;
-
   guint i;
 
   TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED(base, context);
@@ -115,34 +456,58 @@ fb_connection_avatars_request_avatars(TpSvcConnectionInterfaceAvatars *self,
     return;
   }
 
-  if (contacts->len)
+  tp_svc_connection_interface_avatars_return_from_request_avatars(context);
+
+  for (i = 0; i < contacts->len; i++)
   {
-    struct avatar_request_queue *arq = g_new(struct avatar_request_queue, 1);
+    TpHandle handle = g_array_index(contacts, TpHandle, i);
+    FbContact *c = fb_contact_list_get_user(contact_list, handle);
+    GBytes *cached;
 
-    arq->conn = g_object_ref(conn);
-    arq->http = fb_http_new(FB_API_AGENT);
-    arq->queue = g_queue_new();
+    if (!c || !c->icon)
+      continue;
 
-    for (i = 0; i < contacts->len; i++)
+    /* the token identifies the image version, old entries still get
+     * revalidated by the fetcher now and then */
+    if (fb_avatar_cache_is_fresh(cache, c->avatar_token) &&
+        (cached = fb_avatar_cache_lookup(cache, c->avatar_token)))
     {
-      TpHandle handle = g_array_index(contacts, TpHandle, i);
-      FbContact *c = fb_contact_list_get_user(contact_list, handle);
+      FB_DEBUG("avatar %s served from cache", c->avatar_token);
 
-      if (c->icon)
-        g_queue_push_head(arq->queue, c);
+      fb_connection_avatars_emit_retrieved(conn, handle, c->avatar_token,
+                                           cached);
     }
+    else
+      fb_avatar_fetcher_fetch(fetcher, handle);
+  }
+}
 
-    FbContact *c = g_queue_peek_tail(arq->queue);
-    FbHttpRequest *req = fb_http_request_new(arq->http, c->icon, FALSE,
-                                             avatar_cb, arq);
+static const gchar *avatar_mime_types[] = { "image/jpeg", NULL };
 
-    g_idle_add_full(G_PRIORITY_LOW, idle_send_req, req, NULL);
-  }
+/* tokens are only ever known from the roster, no network involved */
+static const gchar *
+fb_connection_avatars_get_token(FbContactList *contact_list, TpHandle handle,
+                                gboolean *known)
+{
+  FbContact *c = fb_contact_list_get_user(contact_list, handle);
 
-  tp_svc_connection_interface_avatars_return_from_request_avatars(context);
+  *known = c != NULL;
+
+  if (!c || !c->icon)
+    return "";
+
+  return c->avatar_token ? c->avatar_token : "";
+}
+
+static void
+fb_connection_avatars_get_avatar_requirements(
+  TpSvcConnectionInterfaceAvatars *iface, DBusGMethodInvocation *context)
+{
+  /* we can't set avatars, so there are no size limits to report */
+  tp_svc_connection_interface_avatars_return_from_get_avatar_requirements(
+    context, avatar_mime_types, 0, 0, 0, 0, 0);
 }
 
-#if 0
 static void
 fb_connection_avatars_get_known_avatar_tokens(
   TpSvcConnectionInterfaceAvatars *iface, const GArray *contacts,
@@ -153,9 +518,7 @@ fb_connection_avatars_get_known_avatar_tokens(
   FbContactList *contact_list = fb_connection_get_contact_list(self);
   TpHandleRepoIface *contact_repo =
     tp_base_connection_get_handles(base, TP_HANDLE_TYPE_CONTACT);
-
-  g_autoptr(GHashTable) tokens =
-    g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  GHashTable *tokens;
   GError *error = NULL;
 
   TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED(base, context);
@@ -167,16 +530,19 @@ fb_connection_avatars_get_known_avatar_tokens(
     return;
   }
 
+  /* tokens are owned by the contact list */
+  tokens = g_hash_table_new(g_direct_hash, g_direct_equal);
+
   for (guint i = 0; i < contacts->len; i++)
   {
     TpHandle handle = g_array_index(contacts, TpHandle, i);
-    FbContact *c = fb_contact_list_get_user(contact_list, handle);
+    gboolean known;
+    const gchar *token = fb_connection_avatars_get_token(contact_list, handle,
+                                                         &known);
 
-    if (c && c->avatar_token)
-    {
-      g_hash_table_insert(tokens, GUINT_TO_POINTER(handle),
-                          g_strdup(c->avatar_token));
-    }
+    /* contacts we know nothing about yet must be left out */
+    if (known)
+      g_hash_table_insert(tokens, GUINT_TO_POINTER(handle), (gchar *)token);
   }
 
   tp_svc_connection_interface_avatars_return_from_get_known_avatar_tokens(
@@ -187,17 +553,16 @@ fb_connection_avatars_get_known_avatar_tokens(
 
 static void
 fb_connection_avatars_get_avatar_tokens(
-  TpSvcConnectionInterfaceAvatars *avatars, const GArray *contacts,
+  TpSvcConnectionInterfaceAvatars *iface, const GArray *contacts,
   DBusGMethodInvocation *context)
 {
-  FbConnection *self = FB_CONNECTION(avatars);
-  TpBaseConnection *base = TP_BASE_CONNECTION(avatars);
+  FbConnection *self = FB_CONNECTION(iface);
+  TpBaseConnection *base = TP_BASE_CONNECTION(iface);
+  FbContactList *contact_list = fb_connection_get_contact_list(self);
   TpHandleRepoIface *contact_repo =
     tp_base_connection_get_handles(base, TP_HANDLE_TYPE_CONTACT);
-  FbContactList *contact_list = fb_connection_get_contact_list(self);
+  const gchar **tokens;
   GError *error = NULL;
-  GHashTable *result;
-  guint i;
 
   TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED(base, context);
 
@@ -208,27 +573,21 @@ fb_connection_avatars_get_avatar_tokens(
     return;
   }
 
-  result = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, NULL);
+  tokens = g_new0(const gchar *, contacts->len + 1);
 
-  for (i = 0; i < contacts->len; i++)
+  for (guint i = 0; i < contacts->len; i++)
   {
     TpHandle handle = g_array_index(contacts, TpHandle, i);
-    FbContact *c = fb_contact_list_get_user(contact_list, handle);
-
-    if (c->avatar_token)
-    {
-      tp_svc_connection_interface_avatars_emit_avatar_updated(
-        self, handle, c->avatar_token);
-    }
+    gboolean known;
 
-    g_hash_table_insert(result, GUINT_TO_POINTER(handle), c->avatar_token);
+    tokens[i] = fb_connection_avatars_get_token(contact_list, handle, &known);
   }
 
-  tp_svc_connection_interface_avatars_return_from_get_known_avatar_tokens(
-    context, result);
-  g_hash_table_unref(result);
+  tp_svc_connection_interface_avatars_return_from_get_avatar_tokens(
+    context, tokens);
+
+  g_free(tokens);
 }
-#endif
 
 void
 fb_connection_avatars_iface_init (gpointer g_iface, gpointer iface_data)
@@ -239,9 +598,9 @@ fb_connection_avatars_iface_init (gpointer g_iface, gpointer iface_data)
 #define IMPLEMENT(x) \
   tp_svc_connection_interface_avatars_implement_ ## x( \
     klass, fb_connection_avatars_ ## x)
-//    IMPLEMENT(get_avatar_requirements);
-//    IMPLEMENT(get_avatar_tokens);
-//    IMPLEMENT(get_known_avatar_tokens);
+  IMPLEMENT(get_avatar_requirements);
+  IMPLEMENT(get_avatar_tokens);
+  IMPLEMENT(get_known_avatar_tokens);
   IMPLEMENT(request_avatars);
 //    IMPLEMENT(set_avatar);
 //    IMPLEMENT(clear_avatar);
@@ -259,11 +618,12 @@ fb_connection_avatars_fill_contact_attributes(GObject *object,
   for (guint i = 0; i < contacts->len; i++)
   {
     TpHandle handle = g_array_index(contacts, TpHandle, i);
+    gboolean known;
     const gchar *token;
 
-    token = fb_contact_list_get_user(contact_list, handle)->avatar_token;
+    token = fb_connection_avatars_get_token(contact_list, handle, &known);
 
-    if (!token)
+    if (!known)
       continue;
 
     tp_contacts_mixin_set_contact_attribute(
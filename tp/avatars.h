@@ -24,8 +24,28 @@
 
 #include "facebook-api.h"
 
+#include "connection.h"
+
 G_BEGIN_DECLS
 
+typedef struct _FbAvatarFetcher FbAvatarFetcher;
+
+/* default number of avatar downloads a connection keeps in flight */
+#define FB_AVATAR_FETCHER_MAX_REQUESTS 4
+
+FbAvatarFetcher *
+fb_avatar_fetcher_new(FbConnection *conn, guint max_requests);
+
+void
+fb_avatar_fetcher_fetch(FbAvatarFetcher *fetcher, TpHandle handle);
+
+/* warms the avatar cache with the whole roster, in the background */
+void
+fb_avatar_fetcher_prefetch(FbAvatarFetcher *fetcher);
+
+void
+fb_avatar_fetcher_free(FbAvatarFetcher *fetcher);
+
 void
 fb_connection_avatars_init(GObject *object);
 
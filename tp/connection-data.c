@@ -21,10 +21,25 @@
 
 #include "connection-data.h"
 
+#include <glib/gstdio.h>
 #include <json-glib/json-glib.h>
 
 #define FB_STATE_DIR "telepathy-facebook"
 #define FB_STATE_FILE "state.json"
+#define FB_STATE_FILE_MIGRATED FB_STATE_FILE ".migrated"
+#define FB_STATE_ACCOUNTS_DIR "accounts"
+#define FB_STATE_ACCOUNT_EXT ".state"
+#define FB_STATE_ACCOUNT_JSON_EXT ".json"
+
+/* on-disk format of an account file, a serialized GVariant */
+#define FB_STATE_VARIANT_TYPE G_VARIANT_TYPE_VARDICT
+
+static GHashTable *
+table_new(void)
+{
+  return g_hash_table_new_full(g_str_hash, g_str_equal,
+                               g_free, (GDestroyNotify)g_variant_unref);
+}
 
 static gchar *
 get_state_file_path(void)
@@ -36,58 +51,329 @@ get_state_file_path(void)
   );
 }
 
-GHashTable *
-fb_connection_data_load(const gchar *fb_id)
+static gchar *
+get_accounts_dir_path(void)
 {
-  g_return_val_if_fail(fb_id != NULL, NULL);
+  return g_build_filename(g_get_user_data_dir(),
+                          FB_STATE_DIR,
+                          FB_STATE_ACCOUNTS_DIR,
+                          NULL);
+}
 
-  gchar *path = get_state_file_path();
+static gchar *
+get_account_file_path(const gchar *fb_id, const gchar *ext)
+{
+  /* fb_id is an email or a phone number, escape it to get a safe file name */
+  gchar *escaped = g_uri_escape_string(fb_id, NULL, FALSE);
+  gchar *name = g_strconcat(escaped, ext, NULL);
+  gchar *dir_path = get_accounts_dir_path();
+  gchar *path = g_build_filename(dir_path, name, NULL);
 
-  if (!g_file_test(path, G_FILE_TEST_EXISTS))
+  g_free(dir_path);
+  g_free(name);
+  g_free(escaped);
+
+  return path;
+}
+
+/* JSON files only ever stored strings, typed getters parse those on demand */
+static GHashTable *
+entry_to_table(JsonObject *entry)
+{
+  GHashTable *table = table_new();
+  GList *members = json_object_get_members(entry);
+
+  for (GList *l = members; l != NULL; l = l->next)
   {
-    g_free(path);
-    return g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    const gchar *key = l->data;
+    const gchar *value = json_object_get_string_member(entry, key);
+
+    if (value)
+    {
+      g_hash_table_insert(table, g_strdup(key),
+                          g_variant_ref_sink(g_variant_new_string(value)));
+    }
   }
 
+  g_list_free(members);
+
+  return table;
+}
+
+static GHashTable *
+variant_to_table(GVariant *dict)
+{
+  GHashTable *table = table_new();
+  GVariantIter iter;
+  gchar *key;
+  GVariant *value;
+
+  g_variant_iter_init(&iter, dict);
+
+  /* g_variant_iter_next() transfers both key and value to us */
+  while (g_variant_iter_next(&iter, "{sv}", &key, &value))
+    g_hash_table_insert(table, key, value);
+
+  return table;
+}
+
+static GVariant *
+table_to_variant(GHashTable *data)
+{
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init(&builder, FB_STATE_VARIANT_TYPE);
+  g_hash_table_iter_init(&iter, data);
+
+  while (g_hash_table_iter_next(&iter, &key, &value))
+    g_variant_builder_add(&builder, "{sv}", key, value);
+
+  return g_variant_ref_sink(g_variant_builder_end(&builder));
+}
+
+/* g_file_set_contents() writes to a temporary file and renames it over the
+ * destination, so readers never see a partially written account file */
+static gboolean
+write_account_file(const gchar *path, const gchar *contents, gsize length)
+{
   GError *error = NULL;
+
+  if (!g_file_set_contents(path, contents, length, &error))
+  {
+    g_warning("Failed to save connection data: %s", error->message);
+    g_error_free(error);
+    return FALSE;
+  }
+
+  g_chmod(path, 0600);
+
+  return TRUE;
+}
+
+static gboolean
+save_account_entry(const gchar *fb_id, GHashTable *data)
+{
+  gchar *dir_path = get_accounts_dir_path();
+  gchar *path = get_account_file_path(fb_id, FB_STATE_ACCOUNT_EXT);
+  GVariant *dict = table_to_variant(data);
+  gboolean ok;
+
+  g_mkdir_with_parents(dir_path, 0700);
+  ok = write_account_file(path, g_variant_get_data(dict),
+                          g_variant_get_size(dict));
+
+  g_variant_unref(dict);
+  g_free(path);
+  g_free(dir_path);
+
+  return ok;
+}
+
+static GVariant *
+load_variant_file(const gchar *path, const GVariantType *type, GError **error)
+{
+  GMappedFile *file = g_mapped_file_new(path, FALSE, error);
+  GBytes *bytes;
+  GVariant *value;
+
+  if (!file)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes(file);
+  g_mapped_file_unref(file);
+
+  /* untrusted, GVariant validates the data as it is accessed */
+  value = g_variant_ref_sink(g_variant_new_from_bytes(type, bytes, FALSE));
+  g_bytes_unref(bytes);
+
+  return value;
+}
+
+static GHashTable *
+load_account_entry(const gchar *path, GError **error)
+{
+  GVariant *dict = load_variant_file(path, FB_STATE_VARIANT_TYPE, error);
+  GHashTable *table;
+
+  if (!dict)
+    return NULL;
+
+  table = variant_to_table(dict);
+  g_variant_unref(dict);
+
+  return table;
+}
+
+static GHashTable *
+load_json_account_entry(const gchar *path, GError **error)
+{
   JsonParser *parser = json_parser_new();
+  GHashTable *table = NULL;
+
+  if (json_parser_load_from_file(parser, path, error))
+  {
+    JsonNode *root = json_parser_get_root(parser);
+
+    if (JSON_NODE_HOLDS_OBJECT(root))
+      table = entry_to_table(json_node_get_object(root));
+    else
+      table = table_new();
+  }
+
+  g_object_unref(parser);
+
+  return table;
+}
+
+/*
+ * Older versions kept all accounts in a single state.json, keyed by Fb ID.
+ * Split it to per-account files the first time we see it and move it out of
+ * the way, accounts that already have their own file are left untouched.
+ */
+static void
+migrate_legacy_state(void)
+{
+  static gboolean migrated = FALSE;
+  gchar *path;
+  GError *error = NULL;
+  JsonParser *parser;
+  JsonNode *root;
+
+  if (migrated)
+    return;
+
+  migrated = TRUE;
+  path = get_state_file_path();
+
+  if (!g_file_test(path, G_FILE_TEST_EXISTS))
+  {
+    g_free(path);
+    return;
+  }
+
+  parser = json_parser_new();
 
   if (!json_parser_load_from_file(parser, path, &error))
   {
-    g_warning("Failed to load state file: %s", error->message);
+    g_warning("Failed to load legacy state file: %s", error->message);
     g_error_free(error);
     g_object_unref(parser);
     g_free(path);
-    return NULL;
+    return;
   }
 
-  JsonNode *root = json_parser_get_root(parser);
-  JsonObject *top = json_node_get_object(root);
+  root = json_parser_get_root(parser);
 
-  if (!json_object_has_member(top, fb_id))
+  if (JSON_NODE_HOLDS_OBJECT(root))
+  {
+    JsonObject *top = json_node_get_object(root);
+    GList *ids = json_object_get_members(top);
+    gboolean ok = TRUE;
+
+    for (GList *l = ids; l != NULL; l = l->next)
+    {
+      const gchar *fb_id = l->data;
+      JsonNode *node = json_object_get_member(top, fb_id);
+      gchar *account_path;
+      gchar *json_path;
+
+      if (!JSON_NODE_HOLDS_OBJECT(node))
+        continue;
+
+      account_path = get_account_file_path(fb_id, FB_STATE_ACCOUNT_EXT);
+      json_path = get_account_file_path(fb_id, FB_STATE_ACCOUNT_JSON_EXT);
+
+      if (!g_file_test(account_path, G_FILE_TEST_EXISTS) &&
+          !g_file_test(json_path, G_FILE_TEST_EXISTS))
+      {
+        GHashTable *table = entry_to_table(json_node_get_object(node));
+
+        ok &= save_account_entry(fb_id, table);
+        g_hash_table_destroy(table);
+      }
+
+      g_free(json_path);
+      g_free(account_path);
+    }
+
+    g_list_free(ids);
+
+    if (ok)
+    {
+      gchar *dir_path = g_path_get_dirname(path);
+      gchar *migrated_path = g_build_filename(dir_path,
+                                              FB_STATE_FILE_MIGRATED, NULL);
+
+      if (g_rename(path, migrated_path))
+        g_warning("Failed to rename legacy state file %s", path);
+
+      g_free(migrated_path);
+      g_free(dir_path);
+    }
+  }
+
+  g_object_unref(parser);
+  g_free(path);
+}
+
+/* per-account JSON files predate the binary format, convert them once */
+static GHashTable *
+migrate_json_account(const gchar *fb_id)
+{
+  gchar *path = get_account_file_path(fb_id, FB_STATE_ACCOUNT_JSON_EXT);
+  GError *error = NULL;
+  GHashTable *table;
+
+  if (!g_file_test(path, G_FILE_TEST_EXISTS))
   {
-    g_object_unref(parser);
     g_free(path);
-    return g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    return NULL;
   }
 
-  JsonObject *entry = json_object_get_object_member(top, fb_id);
-  GList *members = json_object_get_members(entry);
+  table = load_json_account_entry(path, &error);
 
-  GHashTable *table = g_hash_table_new_full(g_str_hash,
-                                            g_str_equal,
-                                            g_free,
-                                            g_free);
+  if (!table)
+  {
+    g_warning("Failed to load state file: %s", error->message);
+    g_error_free(error);
+  }
+  else if (save_account_entry(fb_id, table))
+    g_unlink(path);
 
-  for (GList *l = members; l != NULL; l = l->next)
+  g_free(path);
+
+  return table;
+}
+
+GHashTable *
+fb_connection_data_load(const gchar *fb_id)
+{
+  g_return_val_if_fail(fb_id != NULL, NULL);
+
+  migrate_legacy_state();
+
+  gchar *path = get_account_file_path(fb_id, FB_STATE_ACCOUNT_EXT);
+  GError *error = NULL;
+  GHashTable *table;
+
+  if (!g_file_test(path, G_FILE_TEST_EXISTS))
   {
-    const gchar *key = l->data;
-    const gchar *value = json_object_get_string_member(entry, key);
-    g_hash_table_insert(table, g_strdup(key), g_strdup(value));
+    g_free(path);
+    table = migrate_json_account(fb_id);
+
+    return table ? table : table_new();
+  }
+
+  table = load_account_entry(path, &error);
+
+  if (!table)
+  {
+    g_warning("Failed to load state file: %s", error->message);
+    g_error_free(error);
   }
 
-  g_list_free(members);
-  g_object_unref(parser);
   g_free(path);
   return table;
 }
@@ -98,115 +384,404 @@ fb_connection_data_save(const gchar *fb_id, GHashTable *data)
   g_return_val_if_fail(fb_id != NULL, FALSE);
   g_return_val_if_fail(data != NULL, FALSE);
 
-  gchar *dir_path = g_build_filename(g_get_user_data_dir(),
-                                     FB_STATE_DIR,
-                                     NULL);
+  return save_account_entry(fb_id, data);
+}
+
+struct _FbConnectionDataBlob
+{
+  gchar *path;
+  GVariant *value;
+};
+
+typedef struct _FbConnectionDataBlob FbConnectionDataBlob;
+
+static gchar *
+get_blob_file_path(const gchar *fb_id, const gchar *name)
+{
+  gchar *ext = g_strconcat(".", name, NULL);
+  gchar *path = get_account_file_path(fb_id, ext);
+
+  g_free(ext);
+
+  return path;
+}
+
+static void
+blob_write_func(gpointer data, gpointer user_data)
+{
+  FbConnectionDataBlob *blob = data;
+  gchar *dir_path = get_accounts_dir_path();
+
   g_mkdir_with_parents(dir_path, 0700);
+  write_account_file(blob->path, g_variant_get_data(blob->value),
+                     g_variant_get_size(blob->value));
 
-  gchar *path = get_state_file_path();
+  g_free(dir_path);
+  g_variant_unref(blob->value);
+  g_free(blob->path);
+  g_slice_free(FbConnectionDataBlob, blob);
+}
 
+GVariant *
+fb_connection_data_load_variant(const gchar *fb_id, const gchar *name,
+                                const GVariantType *type)
+{
+  gchar *path;
+  GVariant *value;
   GError *error = NULL;
-  JsonParser *parser = json_parser_new();
-  JsonObject *top = json_object_new();
 
-  if (g_file_test(path, G_FILE_TEST_EXISTS))
+  g_return_val_if_fail(fb_id != NULL, NULL);
+  g_return_val_if_fail(name != NULL, NULL);
+
+  path = get_blob_file_path(fb_id, name);
+  value = load_variant_file(path, type, &error);
+
+  if (!value)
   {
-    if (json_parser_load_from_file(parser, path, &error))
-    {
-      JsonNode *root = json_parser_get_root(parser);
+    if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+      g_warning("Failed to load %s: %s", path, error->message);
 
-      if (JSON_NODE_HOLDS_OBJECT(root))
-      {
-        JsonObject *existing = json_node_get_object(root);
-        GList *keys = json_object_get_members(existing);
-
-        for (GList *l = keys; l != NULL; l = l->next)
-        {
-          const gchar *key = l->data;
-
-          if (g_strcmp0(key, fb_id) != 0)
-          {
-            JsonNode *copy = json_node_copy(json_object_get_member(existing,
-                                                                   key));
-            json_object_set_member(top, key, copy);
-          }
-        }
-
-        g_list_free(keys);
-      }
-    }
-    else
-    {
-      g_warning("Failed to parse state file: %s", error->message);
-      g_clear_error(&error);
-    }
+    g_error_free(error);
   }
 
-  // Build new object for this fb_id
-  JsonBuilder *builder = json_builder_new();
-  json_builder_begin_object(builder);
+  g_free(path);
+
+  return value;
+}
+
+void
+fb_connection_data_save_variant(const gchar *fb_id, const gchar *name,
+                                GVariant *value)
+{
+  /* a single thread, so writes to the same file happen in order */
+  static GThreadPool *pool = NULL;
+  FbConnectionDataBlob *blob;
+
+  g_return_if_fail(fb_id != NULL);
+  g_return_if_fail(name != NULL);
+  g_return_if_fail(value != NULL);
+
+  if (G_UNLIKELY(!pool))
+    pool = g_thread_pool_new(blob_write_func, NULL, 1, FALSE, NULL);
+
+  blob = g_slice_new(FbConnectionDataBlob);
+  blob->path = get_blob_file_path(fb_id, name);
+  blob->value = g_variant_ref_sink(value);
+
+  g_thread_pool_push(pool, blob, NULL);
+}
+
+struct _FbConnectionDataWriter
+{
+  gint ref_count;
+  gchar *fb_id;
+  guint delay;
+  guint timeout_id;
+  /* last snapshot handed over for writing */
+  GHashTable *saved;
+  /* snapshot waiting for the save window to expire */
+  GHashTable *pending;
+  guint64 serial;
+  /* serializes the disk writes, protects @written */
+  GMutex lock;
+  guint64 written;
+};
+
+struct _FbConnectionDataJob
+{
+  FbConnectionDataWriter *writer;
+  GHashTable *data;
+  guint64 serial;
+};
+
+typedef struct _FbConnectionDataJob FbConnectionDataJob;
 
+/* values are immutable, a snapshot only needs to reference them */
+static GHashTable *
+table_copy(GHashTable *data)
+{
+  GHashTable *copy = table_new();
   GHashTableIter iter;
   gpointer key, value;
+
+  g_hash_table_iter_init(&iter, data);
+
+  while (g_hash_table_iter_next(&iter, &key, &value))
+    g_hash_table_insert(copy, g_strdup(key), g_variant_ref(value));
+
+  return copy;
+}
+
+static gboolean
+table_is_dirty(GHashTable *saved, GHashTable *data)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (!saved || g_hash_table_size(saved) != g_hash_table_size(data))
+    return TRUE;
+
   g_hash_table_iter_init(&iter, data);
 
   while (g_hash_table_iter_next(&iter, &key, &value))
   {
-    json_builder_set_member_name(builder, key);
-    json_builder_add_string_value(builder, value);
+    GVariant *old = g_hash_table_lookup(saved, key);
+
+    if (!old || !g_variant_equal(old, value))
+      return TRUE;
   }
 
-  json_builder_end_object(builder);
-  JsonNode *entry_node = json_builder_get_root(builder);
-  json_object_set_member(top, fb_id, entry_node);
+  return FALSE;
+}
+
+static FbConnectionDataWriter *
+fb_connection_data_writer_ref(FbConnectionDataWriter *writer)
+{
+  g_atomic_int_inc(&writer->ref_count);
+
+  return writer;
+}
+
+static void
+fb_connection_data_writer_unref(FbConnectionDataWriter *writer)
+{
+  if (!g_atomic_int_dec_and_test(&writer->ref_count))
+    return;
 
-  // Save full JSON object to file
-  JsonGenerator *gen = json_generator_new();
-  JsonNode *root_node = json_node_new(JSON_NODE_OBJECT);
-  json_node_set_object(root_node, top);
-  json_generator_set_root(gen, root_node);
+  g_mutex_clear(&writer->lock);
+  g_free(writer->fb_id);
+  g_slice_free(FbConnectionDataWriter, writer);
+}
 
-  gboolean ok = json_generator_to_file(gen, path, &error);
+static void
+fb_connection_data_job_free(gpointer data)
+{
+  FbConnectionDataJob *job = data;
 
-  if (!ok)
+  g_hash_table_unref(job->data);
+  fb_connection_data_writer_unref(job->writer);
+  g_slice_free(FbConnectionDataJob, job);
+}
+
+static void
+fb_connection_data_job_run(FbConnectionDataJob *job)
+{
+  FbConnectionDataWriter *writer = job->writer;
+
+  g_mutex_lock(&writer->lock);
+
+  /* a synchronous flush might have already written newer data */
+  if (job->serial > writer->written)
   {
-    g_warning("Failed to save connection data: %s", error->message);
-    g_error_free(error);
+    fb_connection_data_save(writer->fb_id, job->data);
+    writer->written = job->serial;
   }
 
-  // Cleanup
-  json_node_free(root_node);
-  g_object_unref(gen);
-  g_object_unref(builder);
-  g_object_unref(parser);
-  g_free(path);
-  g_free(dir_path);
+  g_mutex_unlock(&writer->lock);
+}
 
-  return ok;
+static void
+fb_connection_data_job_thread(GTask *task, gpointer source_object,
+                              gpointer task_data, GCancellable *cancellable)
+{
+  fb_connection_data_job_run(task_data);
 }
 
-const gchar *
-fb_connection_data_get_string(GHashTable *data, const gchar *key)
+static void
+fb_connection_data_writer_dispatch(FbConnectionDataWriter *writer,
+                                   gboolean async)
+{
+  FbConnectionDataJob *job = g_slice_new(FbConnectionDataJob);
+
+  job->writer = fb_connection_data_writer_ref(writer);
+  job->data = writer->pending;
+  job->serial = ++writer->serial;
+  writer->pending = NULL;
+
+  /* snapshots are never modified once taken, so share it with the job */
+  if (writer->saved)
+    g_hash_table_unref(writer->saved);
+
+  writer->saved = g_hash_table_ref(job->data);
+
+  if (async)
+  {
+    GTask *task = g_task_new(NULL, NULL, NULL, NULL);
+
+    g_task_set_task_data(task, job, fb_connection_data_job_free);
+    g_task_run_in_thread(task, fb_connection_data_job_thread);
+    g_object_unref(task);
+  }
+  else
+  {
+    fb_connection_data_job_run(job);
+    fb_connection_data_job_free(job);
+  }
+}
+
+static gboolean
+fb_connection_data_writer_timeout_cb(gpointer user_data)
+{
+  FbConnectionDataWriter *writer = user_data;
+
+  writer->timeout_id = 0;
+
+  if (writer->pending)
+    fb_connection_data_writer_dispatch(writer, TRUE);
+
+  return G_SOURCE_REMOVE;
+}
+
+FbConnectionDataWriter *
+fb_connection_data_writer_new(const gchar *fb_id, GHashTable *data,
+                              guint delay)
+{
+  FbConnectionDataWriter *writer;
+
+  g_return_val_if_fail(fb_id != NULL, NULL);
+
+  writer = g_slice_new0(FbConnectionDataWriter);
+  writer->ref_count = 1;
+  writer->fb_id = g_strdup(fb_id);
+  writer->delay = delay;
+  g_mutex_init(&writer->lock);
+
+  if (data)
+    writer->saved = table_copy(data);
+
+  return writer;
+}
+
+void
+fb_connection_data_writer_queue(FbConnectionDataWriter *writer,
+                                GHashTable *data)
+{
+  g_return_if_fail(writer != NULL);
+  g_return_if_fail(data != NULL);
+
+  if (!table_is_dirty(writer->pending ? writer->pending : writer->saved, data))
+    return;
+
+  if (writer->pending)
+    g_hash_table_unref(writer->pending);
+
+  writer->pending = table_copy(data);
+
+  /* do not re-arm, changes within the window are coalesced */
+  if (!writer->timeout_id)
+  {
+    writer->timeout_id = g_timeout_add(
+      writer->delay, fb_connection_data_writer_timeout_cb, writer);
+  }
+}
+
+void
+fb_connection_data_writer_flush(FbConnectionDataWriter *writer)
+{
+  g_return_if_fail(writer != NULL);
+
+  if (writer->timeout_id)
+  {
+    g_source_remove(writer->timeout_id);
+    writer->timeout_id = 0;
+  }
+
+  if (writer->pending)
+    fb_connection_data_writer_dispatch(writer, FALSE);
+}
+
+void
+fb_connection_data_writer_free(FbConnectionDataWriter *writer)
+{
+  g_return_if_fail(writer != NULL);
+
+  fb_connection_data_writer_flush(writer);
+  g_clear_pointer(&writer->saved, g_hash_table_unref);
+  fb_connection_data_writer_unref(writer);
+}
+
+static GVariant *
+lookup(GHashTable *data, const gchar *key)
 {
   g_return_val_if_fail(data != NULL && key != NULL, NULL);
 
   return g_hash_table_lookup(data, key);
 }
 
+static gboolean
+variant_get_int64(GVariant *value, gint64 *out)
+{
+  switch (g_variant_classify(value))
+  {
+    case G_VARIANT_CLASS_BOOLEAN:
+    {
+      *out = g_variant_get_boolean(value);
+      return TRUE;
+    }
+    case G_VARIANT_CLASS_INT32:
+    {
+      *out = g_variant_get_int32(value);
+      return TRUE;
+    }
+    case G_VARIANT_CLASS_INT64:
+    {
+      *out = g_variant_get_int64(value);
+      return TRUE;
+    }
+    case G_VARIANT_CLASS_UINT64:
+    {
+      *out = (gint64)g_variant_get_uint64(value);
+      return TRUE;
+    }
+    case G_VARIANT_CLASS_STRING:
+    {
+      const gchar *str = g_variant_get_string(value, NULL);
+      char *endptr = NULL;
+
+      *out = g_ascii_strtoll(str, &endptr, 10);
+      return endptr != str;
+    }
+    default:
+      return FALSE;
+  }
+}
+
+static void
+set_value(GHashTable *data, const gchar *key, GVariant *value)
+{
+  GVariant *old = g_hash_table_lookup(data, key);
+
+  g_variant_ref_sink(value);
+
+  if (!old || !g_variant_equal(old, value))
+    g_hash_table_insert(data, g_strdup(key), value);
+  else
+    g_variant_unref(value);
+}
+
+const gchar *
+fb_connection_data_get_string(GHashTable *data, const gchar *key)
+{
+  GVariant *value = lookup(data, key);
+
+  if (!value || !g_variant_is_of_type(value, G_VARIANT_TYPE_STRING))
+    return NULL;
+
+  return g_variant_get_string(value, NULL);
+}
+
 gint
 fb_connection_data_get_int(GHashTable *data,
                                  const gchar *key,
                                  gint default_value)
 {
-  const gchar *str = fb_connection_data_get_string(data, key);
+  GVariant *value = lookup(data, key);
+  gint64 val;
 
-  if (!str)
+  if (!value || !variant_get_int64(value, &val))
     return default_value;
 
-  char *endptr = NULL;
-  gint val = (gint)strtol(str, &endptr, 10);
-
-  return (endptr != str) ? val : default_value;
+  return (gint)val;
 }
 
 gint64
@@ -214,15 +789,13 @@ fb_connection_data_get_int64(GHashTable *data,
                                    const gchar *key,
                                    gint64 default_value)
 {
-  const gchar *str = fb_connection_data_get_string(data, key);
+  GVariant *value = lookup(data, key);
+  gint64 val;
 
-  if (!str)
+  if (!value || !variant_get_int64(value, &val))
     return default_value;
 
-  char *endptr = NULL;
-  gint64 val = g_ascii_strtoll(str, &endptr, 10);
-
-  return (endptr != str) ? val : default_value;
+  return val;
 }
 
 guint64
@@ -230,15 +803,28 @@ fb_connection_data_get_uint64(GHashTable *data,
                                     const gchar *key,
                                     guint64 default_value)
 {
-  const gchar *str = fb_connection_data_get_string(data, key);
+  GVariant *value = lookup(data, key);
+  gint64 val;
 
-  if (!str)
+  if (!value)
     return default_value;
 
-  char *endptr = NULL;
-  guint64 val = g_ascii_strtoull(str, &endptr, 10);
+  if (g_variant_is_of_type(value, G_VARIANT_TYPE_UINT64))
+    return g_variant_get_uint64(value);
+
+  if (g_variant_is_of_type(value, G_VARIANT_TYPE_STRING))
+  {
+    const gchar *str = g_variant_get_string(value, NULL);
+    char *endptr = NULL;
+    guint64 uval = g_ascii_strtoull(str, &endptr, 10);
+
+    return (endptr != str) ? uval : default_value;
+  }
+
+  if (!variant_get_int64(value, &val))
+    return default_value;
 
-  return (endptr != str) ? val : default_value;
+  return (guint64)val;
 }
 
 gboolean
@@ -246,12 +832,33 @@ fb_connection_data_get_bool(GHashTable *data,
                                   const gchar *key,
                                   gboolean default_value)
 {
-  const gchar *str = fb_connection_data_get_string(data, key);
+  GVariant *value = lookup(data, key);
 
-  if (!str)
+  if (!value)
     return default_value;
 
-  return g_ascii_strcasecmp(str, "true") == 0 || g_strcmp0(str, "1") == 0;
+  if (g_variant_is_of_type(value, G_VARIANT_TYPE_BOOLEAN))
+    return g_variant_get_boolean(value);
+
+  if (g_variant_is_of_type(value, G_VARIANT_TYPE_STRING))
+  {
+    const gchar *str = g_variant_get_string(value, NULL);
+
+    return g_ascii_strcasecmp(str, "true") == 0 || g_strcmp0(str, "1") == 0;
+  }
+
+  return default_value;
+}
+
+GBytes *
+fb_connection_data_get_bytes(GHashTable *data, const gchar *key)
+{
+  GVariant *value = lookup(data, key);
+
+  if (!value || !g_variant_is_of_type(value, G_VARIANT_TYPE_BYTESTRING))
+    return NULL;
+
+  return g_variant_get_data_as_bytes(value);
 }
 
 void
@@ -261,7 +868,7 @@ fb_connection_data_set_string(GHashTable *data,
 {
   g_return_if_fail(data && key && value);
 
-  g_hash_table_insert(data, g_strdup(key), g_strdup(value));
+  set_value(data, key, g_variant_new_string(value));
 }
 
 void
@@ -269,10 +876,7 @@ fb_connection_data_set_int(GHashTable *data, const gchar *key, gint value)
 {
   g_return_if_fail(data && key);
 
-  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
-
-  g_snprintf(buf, sizeof(buf), "%d", value);
-  fb_connection_data_set_string(data, key, buf);
+  set_value(data, key, g_variant_new_int32(value));
 }
 
 void
@@ -282,10 +886,7 @@ fb_connection_data_set_int64(GHashTable *data,
 {
   g_return_if_fail(data && key);
 
-  gchar *str = g_strdup_printf("%" G_GINT64_FORMAT, value);
-
-  fb_connection_data_set_string(data, key, str);
-  g_free(str);
+  set_value(data, key, g_variant_new_int64(value));
 }
 
 void
@@ -295,10 +896,7 @@ fb_connection_data_set_uint64(GHashTable *data,
 {
   g_return_if_fail(data && key);
 
-  gchar *str = g_strdup_printf("%" G_GUINT64_FORMAT, value);
-
-  fb_connection_data_set_string(data, key, str);
-  g_free(str);
+  set_value(data, key, g_variant_new_uint64(value));
 }
 
 void
@@ -306,5 +904,18 @@ fb_connection_data_set_bool(GHashTable *data,
                                   const gchar *key,
                                   gboolean value)
 {
-  fb_connection_data_set_string(data, key, value ? "true" : "false");
+  g_return_if_fail(data && key);
+
+  set_value(data, key, g_variant_new_boolean(value));
+}
+
+void
+fb_connection_data_set_bytes(GHashTable *data,
+                             const gchar *key,
+                             GBytes *value)
+{
+  g_return_if_fail(data && key && value);
+
+  set_value(data, key,
+            g_variant_new_from_bytes(G_VARIANT_TYPE_BYTESTRING, value, TRUE));
 }
@@ -27,8 +27,16 @@ G_BEGIN_DECLS
  * @brief Persistent storage for per-account connection data.
  *
  * This API allows saving and loading non-secret account-specific data
- * (e.g., last message ID, timestamps) in a persistent JSON-based store,
- * keyed by Fb ID. All values are stored as strings via `GHashTable`.
+ * (e.g., last message ID, timestamps) in a persistent store, keyed by Fb ID.
+ * Values are kept typed, as `GVariant`s in a `GHashTable`, both in memory
+ * and on disk, so numbers and binary blobs don't go through string
+ * conversions. Getters of numeric types still accept values written as
+ * strings by older versions.
+ *
+ * Every account has its own file under the user data directory, so saving
+ * one account never has to read or rewrite the data of the others. The
+ * legacy shared state.json and the per-account JSON files are converted on
+ * first load.
  */
 
 /**
@@ -38,8 +46,8 @@ G_BEGIN_DECLS
  * Loads the persistent data associated with the given Fb ID from disk.
  * If the file or entry doesn't exist, returns an empty hash table.
  *
- * @returns (transfer full): a `GHashTable *` mapping string keys to string
- *                           values. Caller must free it using
+ * @returns (transfer full): a `GHashTable *` mapping string keys to
+ *                           `GVariant` values. Caller must free it using
  *                           `g_hash_table_destroy()`.
  */
 GHashTable *
@@ -48,22 +56,105 @@ fb_connection_data_load(const gchar *fb_id);
 /**
  * fb_connection_data_save:
  * @fb_id: Fb user ID string (must not be NULL)
- * @data: hash table of key/value string pairs to store (must not be NULL)
+ * @data: hash table of values to store (must not be NULL)
  *
  * Stores the given hash table data under the Fb ID. Replaces any existing
- * values for that user. Persists to a JSON file under the user data directory.
+ * values for that user. Persists to the per-account file under the user
+ * data directory, the file is replaced atomically.
  *
  * @returns: TRUE on success, FALSE on failure.
  */
 gboolean
 fb_connection_data_save(const gchar *fb_id, GHashTable *data);
 
+/**
+ * fb_connection_data_load_variant:
+ * @fb_id: Fb user ID string (must not be NULL)
+ * @name: name of the blob, e.g. "roster"
+ * @type: expected type of the blob
+ *
+ * Loads a blob stored with fb_connection_data_save_variant(). Blobs live in
+ * their own files next to the account data, so large ones don't have to be
+ * rewritten along with it.
+ *
+ * @returns (transfer full) (nullable): the blob, or NULL if there is none.
+ */
+GVariant *
+fb_connection_data_load_variant(const gchar *fb_id, const gchar *name,
+                                const GVariantType *type);
+
+/**
+ * fb_connection_data_save_variant:
+ * @fb_id: Fb user ID string (must not be NULL)
+ * @name: name of the blob
+ * @value: the blob, floating references are sunk
+ *
+ * Schedules @value to be written on a worker thread. Writes are done in the
+ * order they were scheduled.
+ */
+void
+fb_connection_data_save_variant(const gchar *fb_id, const gchar *name,
+                                GVariant *value);
+
+/**
+ * FbConnectionDataWriter:
+ *
+ * Write-behind for fb_connection_data_save(). Queued data is compared with
+ * what was last written and dropped if nothing changed, otherwise changes
+ * made within the save window are coalesced and written from a worker
+ * thread, so the main loop never blocks on disk I/O.
+ */
+typedef struct _FbConnectionDataWriter FbConnectionDataWriter;
+
+/**
+ * fb_connection_data_writer_new:
+ * @fb_id: Fb user ID string (must not be NULL)
+ * @data: (nullable): data as currently stored on disk
+ * @delay: save window in milliseconds
+ *
+ * @returns (transfer full): a new writer, free it with
+ *                           fb_connection_data_writer_free().
+ */
+FbConnectionDataWriter *
+fb_connection_data_writer_new(const gchar *fb_id, GHashTable *data,
+                              guint delay);
+
+/**
+ * fb_connection_data_writer_queue:
+ * @writer: the writer
+ * @data: hash table of values to store
+ *
+ * Schedules @data to be saved once the save window expires. @data is copied,
+ * the caller may keep modifying it.
+ */
+void
+fb_connection_data_writer_queue(FbConnectionDataWriter *writer,
+                                GHashTable *data);
+
+/**
+ * fb_connection_data_writer_flush:
+ * @writer: the writer
+ *
+ * Synchronously writes any pending data.
+ */
+void
+fb_connection_data_writer_flush(FbConnectionDataWriter *writer);
+
+/**
+ * fb_connection_data_writer_free:
+ * @writer: the writer
+ *
+ * Flushes pending data and frees @writer.
+ */
+void
+fb_connection_data_writer_free(FbConnectionDataWriter *writer);
+
 /**
  * fb_connection_data_get_string:
  * @data: Hash table to look up
  * @key: Key string
  *
- * Returns a string value or NULL if key is not present.
+ * Returns a string value or NULL if key is not present or is not a string.
  * Returned string belongs to the hash table; do not free it.
  */
 const gchar *
@@ -102,13 +193,25 @@ fb_connection_data_get_uint64(GHashTable *data,
 
 /**
  * fb_connection_data_get_bool:
- * Interprets "true", "1" as TRUE, otherwise FALSE. Falls back to default.
+ * Returns boolean value or default. Values stored as strings by older
+ * versions are TRUE if "true" or "1".
  */
 gboolean
 fb_connection_data_get_bool(GHashTable *data,
                                   const gchar *key,
                                   gboolean default_value);
 
+/**
+ * fb_connection_data_get_bytes:
+ * @data: Hash table to look up
+ * @key: Key string
+ *
+ * Returns (transfer full): the binary value or NULL if key is not present or
+ * is not binary. Caller must free it using `g_bytes_unref()`.
+ */
+GBytes *
+fb_connection_data_get_bytes(GHashTable *data, const gchar *key);
+
 // Setters
 
 /**
@@ -118,7 +221,8 @@ fb_connection_data_get_bool(GHashTable *data,
  * @value: String value to set
  *
  * Stores the given string @value in @data under @key.
- * Both key and value strings are copied.
+ * Both key and value strings are copied. Setters leave @data untouched if
+ * @key already holds @value.
  */
 void
 fb_connection_data_set_string(GHashTable *data,
@@ -131,7 +235,7 @@ fb_connection_data_set_string(GHashTable *data,
  * @key: Key string
  * @value: Integer value to set
  *
- * Converts the integer @value to string and stores it in @data under @key.
+ * Stores the integer @value in @data under @key.
  */
 void
 fb_connection_data_set_int(GHashTable *data, const gchar *key,
@@ -143,8 +247,7 @@ fb_connection_data_set_int(GHashTable *data, const gchar *key,
  * @key: Key string
  * @value: 64-bit integer value to set
  *
- * Converts the 64-bit integer @value to string and stores it in @data under
- * @key.
+ * Stores the 64-bit integer @value in @data under @key.
  */
 void
 fb_connection_data_set_int64(GHashTable *data,
@@ -157,8 +260,7 @@ fb_connection_data_set_int64(GHashTable *data,
  * @key: Key string
  * @value: 64-bit unsigned integer value to set
  *
- * Converts the 64-bit unsigned integer @value to string and stores it in @data
- * under @key.
+ * Stores the 64-bit unsigned integer @value in @data under @key.
  */
 void
 fb_connection_data_set_uint64(GHashTable *data,
@@ -171,13 +273,27 @@ fb_connection_data_set_uint64(GHashTable *data,
  * @key: Key string
  * @value: Boolean value to set
  *
- * Stores the boolean @value as string "true" or "false" in @data under @key.
+ * Stores the boolean @value in @data under @key.
  */
 void
 fb_connection_data_set_bool(GHashTable *data,
                                   const gchar *key,
                                   gboolean value);
 
+/**
+ * fb_connection_data_set_bytes:
+ * @data: (inout): Hash table to modify
+ * @key: Key string
+ * @value: Binary value to set
+ *
+ * Stores the binary @value in @data under @key. @value is referenced, not
+ * copied.
+ */
+void
+fb_connection_data_set_bytes(GHashTable *data,
+                             const gchar *key,
+                             GBytes *value);
+
 G_END_DECLS
 
 #endif /* __FB_CONNECTION_DATA_H__ */
@@ -36,10 +36,20 @@
 #include "facebook-data.h"
 #include "facebook-mqtt.h"
 #include "facebook-util.h"
+#include "fb-http-ext.h"
+#include "fb-http-stats.h"
+#include "fb-http-trace.h"
 
 #include "account-verify-manager.h"
 #include "contact-list.h"
 
+/* how long to coalesce connection data changes before writing them */
+#define FB_CONNECTION_DATA_SAVE_DELAY 2000
+
+/* bounds of the contacts sync interval, in seconds */
+#define FB_CONTACTS_SYNC_MIN_INTERVAL 60
+#define FB_CONTACTS_SYNC_MAX_INTERVAL (30 * 60)
+
 struct _FbConnectionPrivate
 {
   /** facebook user */
@@ -52,9 +62,25 @@ struct _FbConnectionPrivate
 
   FbApi *api;
   GHashTable *data;
+  FbConnectionDataWriter *data_writer;
 
   FbContactList *contact_list;
 
+  FbAvatarFetcher *avatar_fetcher;
+
+  /** cancels every HTTP request made on behalf of this connection */
+  GCancellable *cancellable;
+
+  /** if the roster was loaded from the snapshot */
+  gboolean roster_cached;
+
+  /** if connecting with the saved token, without logging in first */
+  gboolean fast_connect;
+
+  /** contacts sync timer and its current interval, in seconds */
+  guint sync_id;
+  guint sync_interval;
+
   /** if fb_connection_dispose() has already run once */
   gboolean dispose_has_run;
 };
@@ -344,7 +370,8 @@ fb_connection_save_data(FbConnectionPrivate *priv)
     "twofactor_code"
   };
 
-  guint64 uid, mid;
+  guint64 mid;
+  FbId uid;
 
   for (int i = 0; i < G_N_ELEMENTS(props); i++)
   {
@@ -354,14 +381,30 @@ fb_connection_save_data(FbConnectionPrivate *priv)
 
     if (val)
       fb_connection_data_set_string(priv->data, (gchar *)props[i], val);
+
+    g_free(val);
   }
 
   g_object_get(G_OBJECT(priv->api), "mid", &mid, "uid", &uid, NULL);
 
   fb_connection_data_set_uint64(priv->data, "mid", mid);
-  fb_connection_data_set_uint64(priv->data, "uid", uid);
+  fb_connection_data_set_int64(priv->data, "uid", uid);
+
+  fb_connection_data_writer_queue(priv->data_writer, priv->data);
+}
+
+static void
+fb_connection_start_session(FbConnectionPrivate *priv)
+{
+  TpBaseContactList *contact_list = TP_BASE_CONTACT_LIST(priv->contact_list);
 
-  fb_connection_data_save(priv->fb_id, priv->data);
+  if (tp_base_contact_list_get_state(contact_list, NULL) ==
+      TP_CONTACT_LIST_STATE_NONE)
+  {
+    tp_base_contact_list_set_list_pending(contact_list);
+  }
+
+  fb_api_contacts(priv->api);
 }
 
 static void
@@ -371,11 +414,12 @@ fb_api_auth_cb(FbApi *api, gpointer data)
   FbConnectionPrivate *priv = PRIVATE(conn);
 
   fb_connection_save_data(priv);
+  fb_connection_start_session(priv);
 
-  tp_base_contact_list_set_list_pending(
-    TP_BASE_CONTACT_LIST(priv->contact_list));
-
-  fb_api_contacts(priv->api);
+  /* no need to wait for the roster, the snapshot is published once we are
+   * connected and the fetch reconciles it as pages arrive */
+  if (priv->roster_cached)
+    fb_api_connect(priv->api, FALSE);
 }
 
 static void
@@ -401,7 +445,9 @@ _account_verified_cb(GObject *source, GAsyncResult *result, gpointer user_data)
 
   if (account_verified)
   {
+    fb_http_push_cancellable(priv->cancellable);
     fb_api_auth(priv->api, priv->fb_id, priv->password, NULL);
+    fb_http_pop_cancellable();
     return;
   }
 
@@ -442,6 +488,7 @@ fb_api_connect_cb(FbApi *api, gpointer user_data)
                                    TP_CONNECTION_STATUS_REASON_REQUESTED);
   tp_base_contact_list_set_list_received(
     TP_BASE_CONTACT_LIST(priv->contact_list));
+  fb_avatar_fetcher_prefetch(priv->avatar_fetcher);
 
 //  if (set_getbool(&acct->set, "show_unread"))
 //    fb_api_unread(api);
@@ -456,6 +503,31 @@ fb_cb_api_error(FbApi *api, GError *error, gpointer user_data)
 
   FB_DEBUG("%s", error->message);
 
+  /* the saved token is no longer valid, fall back to a full login */
+  if (priv->fast_connect &&
+      g_error_matches(error, FB_API_ERROR, FB_API_ERROR_AUTH))
+  {
+    FB_DEBUG("saved token rejected, logging in");
+    priv->fast_connect = FALSE;
+
+    /* the login must not carry it, and a crash before the next save must
+     * not bring it back */
+    g_object_set(api, "token", NULL, NULL);
+    g_hash_table_remove(priv->data, "token");
+    fb_connection_data_writer_queue(priv->data_writer, priv->data);
+    fb_connection_data_writer_flush(priv->data_writer);
+
+    fb_http_push_cancellable(priv->cancellable);
+    fb_api_auth(api, priv->fb_id, priv->password, NULL);
+    fb_http_pop_cancellable();
+    return;
+  }
+
+  /* the last requests are the first place to look, unless it is just the
+   * network or a busy server */
+  if (!fb_http_error_is_transient(error))
+    fb_http_trace_dump();
+
   if (error->domain == FB_API_ERROR)
   {
     switch (error->code)
@@ -484,6 +556,41 @@ fb_cb_api_error(FbApi *api, GError *error, gpointer user_data)
                                    TP_CONNECTION_STATUS_DISCONNECTED, reason);
 }
 
+static gboolean
+fb_cb_sync_contacts(gpointer user_data)
+{
+  TpBaseConnection *base_conn = TP_BASE_CONNECTION(user_data);
+  FbConnectionPrivate *priv = PRIVATE(user_data);
+
+  priv->sync_id = 0;
+
+  /* once the full list is in, FbApi asks only for the changes since the
+   * delta cursor it got with it and answers with "contacts-delta" */
+  if (tp_base_connection_get_status(base_conn) ==
+      TP_CONNECTION_STATUS_CONNECTED)
+  {
+    fb_http_push_cancellable(priv->cancellable);
+    fb_api_contacts(priv->api);
+    fb_http_pop_cancellable();
+  }
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+fb_sync_contacts_add_timeout(FbConnection *conn)
+{
+  FbConnectionPrivate *priv = PRIVATE(conn);
+
+  if (priv->sync_id)
+    g_source_remove(priv->sync_id);
+
+  FB_DEBUG("next contacts sync in %us", priv->sync_interval);
+
+  priv->sync_id = g_timeout_add_seconds(priv->sync_interval,
+                                        fb_cb_sync_contacts, conn);
+}
+
 static void
 fb_cb_api_contacts(FbApi *api, GSList *users, gboolean complete,
                    gpointer user_data)
@@ -492,18 +599,67 @@ fb_cb_api_contacts(FbApi *api, GSList *users, gboolean complete,
   FbConnection *conn = FB_CONNECTION(user_data);
   FbConnectionPrivate *priv = PRIVATE(conn);
 
-  fb_contact_list_fb_contacts_changed(priv->contact_list, api, users);
+  /* the token got us a page, so it is good and MQTT can use it too */
+  if (priv->fast_connect)
+  {
+    priv->fast_connect = FALSE;
+
+    if (priv->roster_cached)
+      fb_api_connect(api, FALSE);
+  }
+
+  fb_contact_list_fb_contacts_changed(priv->contact_list, api, users,
+                                      complete);
 
   if (!complete)
     return;
 
-  if (tp_base_connection_get_status(base_conn) !=
+  fb_contact_list_save_snapshot(priv->contact_list, priv->fb_id);
+
+  /* on a first login the list is only received once we are connected,
+   * fb_api_connect_cb() prefetches then */
+  if (tp_base_connection_get_status(base_conn) ==
+      TP_CONNECTION_STATUS_CONNECTED)
+  {
+    fb_avatar_fetcher_prefetch(priv->avatar_fetcher);
+  }
+
+  if (!priv->roster_cached &&
+      tp_base_connection_get_status(base_conn) !=
       TP_CONNECTION_STATUS_CONNECTED)
   {
     fb_api_connect(api, FALSE);
   }
 
-//    fb_sync_contacts_add_timeout(fata);
+  fb_sync_contacts_add_timeout(conn);
+}
+
+static void
+fb_cb_api_contacts_delta(FbApi *api, GSList *added, GSList *removed,
+                         gpointer user_data)
+{
+  FbConnection *conn = FB_CONNECTION(user_data);
+  FbConnectionPrivate *priv = PRIVATE(conn);
+  guint changes = fb_contact_list_fb_contacts_delta(priv->contact_list, api,
+                                                    added, removed);
+
+  /* poll more often while the roster churns, back off while it is quiet */
+  if (changes)
+  {
+    priv->sync_interval = MAX(priv->sync_interval / 2,
+                              FB_CONTACTS_SYNC_MIN_INTERVAL);
+    fb_contact_list_save_snapshot(priv->contact_list, priv->fb_id);
+    fb_avatar_fetcher_prefetch(priv->avatar_fetcher);
+  }
+  else
+  {
+    priv->sync_interval = MIN(priv->sync_interval * 2,
+                              FB_CONTACTS_SYNC_MAX_INTERVAL);
+  }
+
+  FB_DEBUG("%u contacts changed", changes);
+
+  fb_sync_contacts_add_timeout(conn);
 }
 
 static void
@@ -532,7 +688,12 @@ _iface_start_connecting(TpBaseConnection *self, GError **error)
   }
 
   priv->data = fb_connection_data_load(priv->fb_id);
+  priv->data_writer = fb_connection_data_writer_new(
+    priv->fb_id, priv->data, FB_CONNECTION_DATA_SAVE_DELAY);
   priv->api = fb_api_new();
+  priv->cancellable = g_cancellable_new();
+  priv->avatar_fetcher = fb_avatar_fetcher_new(
+    conn, FB_AVATAR_FETCHER_MAX_REQUESTS);
 
   g_object_set(
     priv->api,
@@ -570,6 +731,8 @@ _iface_start_connecting(TpBaseConnection *self, GError **error)
                    G_CALLBACK(fb_cb_api_error), self);
   g_signal_connect(priv->api, "contacts",
                    G_CALLBACK(fb_cb_api_contacts), self);
+  g_signal_connect(priv->api, "contacts-delta",
+                   G_CALLBACK(fb_cb_api_contacts_delta), self);
   g_signal_connect(priv->api, "presences",
                    G_CALLBACK(fb_cb_api_presences), self);
 
@@ -582,11 +745,30 @@ _iface_start_connecting(TpBaseConnection *self, GError **error)
     return FALSE;
 
   tp_base_connection_set_self_handle(self, self_handle);
+
+  priv->roster_cached = fb_contact_list_load_snapshot(
+    priv->contact_list, priv->fb_id,
+    fb_connection_data_get_int64(priv->data, "uid", 0));
+
   tp_base_connection_change_status(self,
                                    TP_CONNECTION_STATUS_CONNECTING,
                                    TP_CONNECTION_STATUS_REASON_REQUESTED);
 
-  fb_api_auth(priv->api, priv->fb_id, priv->password, NULL);
+  fb_http_push_cancellable(priv->cancellable);
+
+  /* reconnects don't have to pay for a login round trip, or risk an account
+   * verify checkpoint, as long as the token we got last time still works */
+  if (fb_connection_data_get_string(priv->data, "token") &&
+      fb_connection_data_get_int64(priv->data, "uid", 0))
+  {
+    FB_DEBUG("reusing saved token");
+    priv->fast_connect = TRUE;
+    fb_connection_start_session(priv);
+  }
+  else
+    fb_api_auth(priv->api, priv->fb_id, priv->password, NULL);
+
+  fb_http_pop_cancellable();
 
   return TRUE;
 }
@@ -596,10 +778,34 @@ _iface_shut_down(TpBaseConnection *base)
 {
   FbConnection *self = FB_CONNECTION(base);
   FbConnectionPrivate *priv = PRIVATE(self);
+  gchar *stats;
+
+  if (priv->sync_id)
+  {
+    g_source_remove(priv->sync_id);
+    priv->sync_id = 0;
+  }
+
+  stats = fb_http_stats_format();
+
+  FB_DEBUG("HTTP latencies:\n%s", stats);
+  g_free(stats);
+
+  /* we are done with whatever the aborted requests still report, there is
+   * no API object if we never got to connect */
+  if (priv->api)
+    g_signal_handlers_disconnect_by_data(priv->api, self);
+
+  tp_clear_pointer(&priv->avatar_fetcher, fb_avatar_fetcher_free);
+
+  /* free sockets and buffers now, not when the responses come in */
+  g_cancellable_cancel(priv->cancellable);
+  tp_clear_object(&priv->cancellable);
 
   fb_api_disconnect(priv->api);
 
   tp_clear_object(&priv->api);
+  tp_clear_pointer(&priv->data_writer, fb_connection_data_writer_free);
   tp_clear_pointer(&priv->data, g_hash_table_destroy);
 
   tp_base_connection_finish_shutdown(base);
@@ -648,11 +854,25 @@ fb_connection_class_init(FbConnectionClass *klass)
     object_class, G_STRUCT_OFFSET(FbConnectionClass, contacts_class));
   tp_base_contact_list_mixin_class_init(parent_class);
   fb_connection_presence_class_init(object_class);
+
+  /* graph queries POST, but have no side effects, so retrying them beats
+   * dropping the connection over a hiccup. Logins are left alone, every
+   * attempt counts against rate limits and may trigger a checkpoint. */
+  fb_http_add_idempotent_url(FB_API_URL_GQL);
+
+  /* nothing works until the login went through, so it must not queue up
+   * behind avatar downloads. Messages are sent over MQTT and never wait on
+   * the HTTP scheduler. */
+  fb_http_add_critical_url(FB_API_URL_AUTH);
 }
 
 static void
 fb_connection_init(FbConnection *self)
-{}
+{
+  FbConnectionPrivate *priv = PRIVATE(self);
+
+  priv->sync_interval = FB_CONTACTS_SYNC_MIN_INTERVAL;
+}
 
 FbContactList *
 fb_connection_get_contact_list(FbConnection *self)
@@ -661,3 +881,19 @@ fb_connection_get_contact_list(FbConnection *self)
 
   return priv->contact_list;
 }
+
+FbAvatarFetcher *
+fb_connection_get_avatar_fetcher(FbConnection *self)
+{
+  FbConnectionPrivate *priv = PRIVATE(self);
+
+  return priv->avatar_fetcher;
+}
+
+GCancellable *
+fb_connection_get_cancellable(FbConnection *self)
+{
+  FbConnectionPrivate *priv = PRIVATE(self);
+
+  return priv->cancellable;
+}
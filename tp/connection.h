@@ -51,12 +51,17 @@ struct _FbContact
   gchar *avatar_token;
   FbApiFriendshipStatus fs;
   gboolean active;
+  /* monotonic time the contact was last seen online, 0 if never */
+  gint64 last_seen;
 };
 
 typedef struct _FbContact FbContact;
 
 typedef struct _FbContactList FbContactList;
 
+/* the typedef lives in avatars.h, which includes this header */
+struct _FbAvatarFetcher;
+
 GType
 fb_connection_get_type(void);
 
@@ -83,6 +88,13 @@ fb_connection_send(FbConnection *conn, const gchar *msg);
 FbContactList *
 fb_connection_get_contact_list(FbConnection *self);
 
+struct _FbAvatarFetcher *
+fb_connection_get_avatar_fetcher(FbConnection *self);
+
+/* cancelled once the connection shuts down */
+GCancellable *
+fb_connection_get_cancellable(FbConnection *self);
+
 const gchar *const *
 fb_connection_get_implemented_interfaces(void);
 
@@ -23,9 +23,14 @@
 
 #include <telepathy-glib/telepathy-glib.h>
 
+#include "connection-data.h"
 #include "contact-list.h"
 #include "debug.h"
 
+/* name and type of the roster snapshot blob */
+#define FB_CONTACT_LIST_SNAPSHOT "roster"
+#define FB_CONTACT_LIST_SNAPSHOT_TYPE "a(xmsmsmsu)"
+
 struct _FbContactListClass
 {
   TpBaseContactListClass parent_class;
@@ -43,6 +48,8 @@ struct _FbContactListPrivate
   TpHandleSet *contacts;
   /* handle -> FbContact */
   GHashTable *fb_contacts;
+  /* contacts seen during the current full fetch */
+  TpHandleSet *synced;
   FbContact me;
 };
 
@@ -100,6 +107,7 @@ fb_contact_list_dispose(GObject *object)
 
   tp_clear_pointer(&priv->fb_contacts, g_hash_table_destroy);
   tp_clear_pointer(&priv->contacts, tp_handle_set_destroy);
+  tp_clear_pointer(&priv->synced, tp_handle_set_destroy);
   fb_contact_clear(&priv->me);
 
   G_OBJECT_CLASS(fb_contact_list_parent_class)->dispose(object);
@@ -222,9 +230,103 @@ get_avatar_token(FbApiUser *user, GRegex *regex)
     return g_strdup(user->csum);
 }
 
-void
-fb_contact_list_fb_contacts_changed(FbContactList *self,
-                                    FbApi *api, GSList *users)
+static FbContact *
+fb_contact_list_ensure_contact(FbContactList *self, FbId uid, FbId my_uid,
+                               TpHandle *handle, gboolean *added)
+{
+  FbContactListPrivate *priv = PRIVATE(self);
+  gchar str_uid[FB_ID_STRMAX];
+  FbContact *c;
+
+  *added = FALSE;
+
+  if (G_UNLIKELY(uid == my_uid))
+  {
+    *handle = tp_base_connection_get_self_handle(priv->conn);
+    priv->me.uid = uid;
+    return &priv->me;
+  }
+
+  FB_ID_TO_STR(uid, str_uid);
+  *handle = tp_handle_ensure(priv->contact_repo, str_uid, NULL, NULL);
+  c = g_hash_table_lookup(priv->fb_contacts, GUINT_TO_POINTER(*handle));
+
+  if (!c)
+  {
+    c = g_slice_new0(FbContact);
+    c->uid = uid;
+    g_hash_table_insert(priv->fb_contacts, GUINT_TO_POINTER(*handle), c);
+    tp_handle_set_add(priv->contacts, *handle);
+    *added = TRUE;
+  }
+
+  return c;
+}
+
+/* takes ownership of @avatar_token, returns TRUE if anything changed */
+static gboolean
+fb_contact_list_update_contact(FbContactList *self, TpHandle handle,
+                               FbContact *c, const gchar *name,
+                               const gchar *icon, gchar *avatar_token,
+                               FbApiFriendshipStatus fs)
+{
+  FbContactListPrivate *priv = PRIVATE(self);
+
+  if (!g_strcmp0(c->name, name) && !g_strcmp0(c->icon, icon) &&
+      !g_strcmp0(c->avatar_token, avatar_token) && c->fs == fs)
+  {
+    g_free(avatar_token);
+    return FALSE;
+  }
+
+  if (c->avatar_token && g_strcmp0(avatar_token, c->avatar_token))
+  {
+    tp_svc_connection_interface_avatars_emit_avatar_updated(
+      priv->conn, handle, avatar_token);
+  }
+
+  fb_contact_clear(c);
+
+  c->name = g_strdup(name);
+  c->icon = g_strdup(icon);
+  c->avatar_token = avatar_token;
+  c->fs = fs;
+
+  return TRUE;
+}
+
+/* drops the contacts the last full fetch did not return */
+static void
+fb_contact_list_remove_stale(FbContactList *self)
+{
+  FbContactListPrivate *priv = PRIVATE(self);
+  TpHandleSet *removed = tp_handle_set_difference(priv->contacts,
+                                                  priv->synced);
+  TpIntsetFastIter iter;
+  TpHandle handle;
+
+  tp_intset_fast_iter_init(&iter, tp_handle_set_peek(removed));
+
+  while (tp_intset_fast_iter_next(&iter, &handle))
+  {
+    FB_DEBUG("contact %s removed",
+             tp_handle_inspect(priv->contact_repo, handle));
+    g_hash_table_remove(priv->fb_contacts, GUINT_TO_POINTER(handle));
+    tp_handle_set_remove(priv->contacts, handle);
+  }
+
+  if (!tp_handle_set_is_empty(removed))
+  {
+    tp_base_contact_list_contacts_changed(
+      TP_BASE_CONTACT_LIST(self), NULL, removed);
+  }
+
+  tp_handle_set_destroy(removed);
+}
+
+/* returns the contacts that were added or changed */
+static TpHandleSet *
+fb_contact_list_apply_users(FbContactList *self, FbApi *api, GSList *users)
 {
   FbContactListPrivate *priv = PRIVATE(self);
   TpHandleSet *contacts = tp_handle_set_new(priv->contact_repo);
@@ -239,59 +341,194 @@ fb_contact_list_fb_contacts_changed(FbContactList *self,
     FbApiUser *user = l->data;
     gchar uid[FB_ID_STRMAX];
     FbContact *c;
-    gchar *avatar_token;
     TpHandle handle;
+    gboolean added;
 
     FB_ID_TO_STR(user->uid, uid);
 
-    FB_DEBUG("contact %s changed name %s icon %s",
-             uid, user->name, user->icon);
+    c = fb_contact_list_ensure_contact(self, user->uid, my_uid, &handle,
+                                       &added);
 
-    if (G_UNLIKELY(user->uid == my_uid))
+    if (c == &priv->me)
     {
-      handle = tp_base_connection_get_self_handle(priv->conn);
-      c = &priv->me;
+      fb_contact_list_update_contact(self, handle, c, user->name, user->icon,
+                                     get_avatar_token(user, regex), user->fs);
+      continue;
     }
-    else
-    {
-      handle = tp_handle_ensure(priv->contact_repo, uid, NULL, NULL);
-      c = g_hash_table_lookup(priv->fb_contacts, GUINT_TO_POINTER(handle));
 
-      if (!c)
-      {
-        c = g_new0(FbContact, 1);
-        g_hash_table_insert(priv->fb_contacts, GUINT_TO_POINTER(handle), c);
-        tp_handle_set_add(priv->contacts, handle);
-      }
+    if (priv->synced)
+      tp_handle_set_add(priv->synced, handle);
 
+    /* only report what differs from the snapshot or the previous fetch */
+    if (fb_contact_list_update_contact(self, handle, c, user->name,
+                                       user->icon,
+                                       get_avatar_token(user, regex),
+                                       user->fs) || added)
+    {
+      FB_DEBUG("contact %s changed name %s icon %s",
+               uid, user->name, user->icon);
       tp_handle_set_add(contacts, handle);
     }
+  }
+
+  g_regex_unref(regex);
+
+  return contacts;
+}
+
+void
+fb_contact_list_fb_contacts_changed(FbContactList *self,
+                                    FbApi *api, GSList *users,
+                                    gboolean complete)
+{
+  FbContactListPrivate *priv = PRIVATE(self);
+  TpHandleSet *contacts;
 
-    avatar_token = get_avatar_token(user, regex);
+  if (!priv->synced)
+    priv->synced = tp_handle_set_new(priv->contact_repo);
 
-    if (c->avatar_token && g_strcmp0(avatar_token, c->avatar_token))
+  contacts = fb_contact_list_apply_users(self, api, users);
+
+  if (!tp_handle_set_is_empty(contacts))
+  {
+    tp_base_contact_list_contacts_changed(
+      TP_BASE_CONTACT_LIST(self), contacts, NULL);
+  }
+
+  tp_handle_set_destroy(contacts);
+
+  if (complete)
+  {
+    fb_contact_list_remove_stale(self);
+    tp_clear_pointer(&priv->synced, tp_handle_set_destroy);
+  }
+}
+
+guint
+fb_contact_list_fb_contacts_delta(FbContactList *self, FbApi *api,
+                                  GSList *added, GSList *removed)
+{
+  FbContactListPrivate *priv = PRIVATE(self);
+  TpHandleSet *changed = fb_contact_list_apply_users(self, api, added);
+  TpHandleSet *gone = tp_handle_set_new(priv->contact_repo);
+  guint count;
+  GSList *l;
+
+  for (l = removed; l != NULL; l = l->next)
+  {
+    TpHandle handle = tp_handle_lookup(priv->contact_repo, l->data, NULL,
+                                       NULL);
+
+    if (handle && g_hash_table_remove(priv->fb_contacts,
+                                      GUINT_TO_POINTER(handle)))
     {
-      tp_svc_connection_interface_avatars_emit_avatar_updated(
-        priv->conn, handle, avatar_token);
+      FB_DEBUG("contact %s removed", (const gchar *)l->data);
+      tp_handle_set_remove(priv->contacts, handle);
+      tp_handle_set_add(gone, handle);
     }
+  }
 
-    fb_contact_clear(c);
+  count = tp_handle_set_size(changed) + tp_handle_set_size(gone);
 
-    c->name = g_strdup(user->name);
-    c->icon = g_strdup(user->icon);
-    c->avatar_token = avatar_token;
-    c->fs = user->fs;
+  if (count)
+  {
+    tp_base_contact_list_contacts_changed(
+      TP_BASE_CONTACT_LIST(self), changed, gone);
   }
 
-  g_regex_unref(regex);
+  tp_handle_set_destroy(gone);
+  tp_handle_set_destroy(changed);
 
-  if (!tp_handle_set_is_empty(contacts))
+  return count;
+}
+
+gboolean
+fb_contact_list_load_snapshot(FbContactList *self, const gchar *fb_id,
+                              FbId my_uid)
+{
+  FbContactListPrivate *priv = PRIVATE(self);
+  TpHandleSet *contacts;
+  GVariant *snapshot;
+  GVariantIter iter;
+  FbId uid;
+  gchar *name, *icon, *avatar_token;
+  guint32 fs;
+  gboolean loaded;
+
+  snapshot = fb_connection_data_load_variant(
+    fb_id, FB_CONTACT_LIST_SNAPSHOT,
+    G_VARIANT_TYPE(FB_CONTACT_LIST_SNAPSHOT_TYPE));
+
+  if (!snapshot)
+    return FALSE;
+
+  contacts = tp_handle_set_new(priv->contact_repo);
+  g_variant_iter_init(&iter, snapshot);
+
+  while (g_variant_iter_next(&iter, "(xmsmsmsu)",
+                             &uid, &name, &icon, &avatar_token, &fs))
+  {
+    TpHandle handle;
+    gboolean added;
+    FbContact *c = fb_contact_list_ensure_contact(self, uid, my_uid, &handle,
+                                                  &added);
+
+    fb_contact_list_update_contact(self, handle, c, name, icon,
+                                   avatar_token, fs);
+
+    if (c != &priv->me)
+      tp_handle_set_add(contacts, handle);
+
+    g_free(name);
+    g_free(icon);
+  }
+
+  loaded = !tp_handle_set_is_empty(contacts);
+
+  FB_DEBUG("%u contacts loaded from snapshot",
+           tp_handle_set_size(contacts));
+
+  if (loaded)
   {
     tp_base_contact_list_contacts_changed(
       TP_BASE_CONTACT_LIST(self), contacts, NULL);
   }
 
   tp_handle_set_destroy(contacts);
+  g_variant_unref(snapshot);
+
+  return loaded;
+}
+
+static void
+add_contact_to_snapshot(GVariantBuilder *builder, FbContact *c)
+{
+  g_variant_builder_add(builder, "(xmsmsmsu)",
+                        c->uid, c->name, c->icon, c->avatar_token,
+                        (guint32)c->fs);
+}
+
+void
+fb_contact_list_save_snapshot(FbContactList *self, const gchar *fb_id)
+{
+  FbContactListPrivate *priv = PRIVATE(self);
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer c;
+
+  g_variant_builder_init(&builder,
+                         G_VARIANT_TYPE(FB_CONTACT_LIST_SNAPSHOT_TYPE));
+
+  if (priv->me.uid)
+    add_contact_to_snapshot(&builder, &priv->me);
+
+  g_hash_table_iter_init(&iter, priv->fb_contacts);
+
+  while (g_hash_table_iter_next(&iter, NULL, &c))
+    add_contact_to_snapshot(&builder, c);
+
+  fb_connection_data_save_variant(fb_id, FB_CONTACT_LIST_SNAPSHOT,
+                                  g_variant_builder_end(&builder));
 }
 
 FbContact *
@@ -57,7 +57,19 @@ fb_contact_list_new(TpBaseConnection *connection);
 
 void
 fb_contact_list_fb_contacts_changed(FbContactList *self,
-                                    FbApi *api, GSList *users);
+                                    FbApi *api, GSList *users,
+                                    gboolean complete);
+
+guint
+fb_contact_list_fb_contacts_delta(FbContactList *self, FbApi *api,
+                                  GSList *added, GSList *removed);
+
+gboolean
+fb_contact_list_load_snapshot(FbContactList *self, const gchar *fb_id,
+                              FbId my_uid);
+
+void
+fb_contact_list_save_snapshot(FbContactList *self, const gchar *fb_id);
 
 FbContact *
 fb_contact_list_get_user(FbContactList *self, TpHandle handle);
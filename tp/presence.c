@@ -129,10 +129,15 @@ fb_contact_list_fb_presences_changed(FbConnection *self, GSList *presences)
     {
       FbContact *c = fb_contact_list_get_user(contact_list, handle);
 
+      if (!c)
+        continue;
+
       if (c->active != pres->active)
       {
         FB_DEBUG("%s presence changed (%d->%d)", uid, c->active, pres->active);
 
+        /* either way they were online up until now */
+        c->last_seen = g_get_monotonic_time();
         c->active = pres->active;
 
         g_hash_table_insert(status_table, GUINT_TO_POINTER(handle),